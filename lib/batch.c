@@ -5,26 +5,78 @@
 #include <math.h>
 
 #define PI 3.14159265358979
-
-Batch batchNew(void) {
-    return (Batch){0, 0, 0, 0, NULL, NULL};
+#define TABN 16 // Number of cached angle tables
+#define CV 65536 // Vertices a Chunk can index
+#define CO 2 // Chunk Overlap, vertices of the chunk before a new one still indexes
+
+// Unit circle directions j * da for j < n.
+typedef struct {
+    size_t n, used;
+    float da;
+    float *c, *s;
+} Tab;
+
+static Tab tab[TABN];
+static size_t tabClock;
+
+static void quadIndices(uint16_t *i, uint16_t f);
+static void fanIndices(uint16_t *i, uint16_t f, size_t n);
+static void stripIndices(uint16_t *i, uint16_t f, size_t n);
+static const Tab *getTab(size_t n, float da);
+static void arcVertices(RVertex*restrict v,size_t step,float x,float y,float r,float o,const Tab*t);
+
+Batch batchNew(int use) {
+    return (Batch){0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, {0, 0, 0, 0, use}, 0, 0};
 }
 
 void batchDel(Batch *b) {
     free(b->i);
     free(b->v);
+    free(b->r);
+    free(b->k);
+    if (b->g.vbo) {
+        rBufDel(&b->g);
+    }
     memset(b, 0, sizeof(*b));
 }
 
 void batchClear(Batch *b) {
-    b->ni = b->nv = 0;
+    b->ni = b->nv = b->nr = b->nk = 0;
+    b->gi = b->gv = 0;
 }
 
-void batchDraw(const Batch *b) {
-    rTris(b->ni, b->i, b->v);
+// Only what was added since the last draw is uploaded; gi and gv count the
+// indices and vertices already on the GPU. There is one draw for each run
+// of one colour within a chunk.
+void batchDraw(Batch *b) {
+    if (!b->g.vbo) {
+        b->g = rBufNew(b->g.use);
+    }
+    if (b->g.mi < b->ni || b->g.mv < b->nv) {
+        b->gi = b->gv = 0;
+    }
+    rBufData(&b->g, b->gi, b->ni - b->gi, b->i + b->gi, b->gv, b->nv - b->gv, b->v + b->gv);
+    b->gi = b->ni;
+    b->gv = b->nv;
+    for (size_t i = 0, r = 0, k = 0; i < b->ni;) {
+        while (r + 1 < b->nr && b->r[r + 1].i <= i) {
+            ++r;
+        }
+        while (k + 1 < b->nk && b->k[k + 1].i <= i) {
+            ++k;
+        }
+        size_t e = b->ni;
+        e = r + 1 < b->nr && b->r[r + 1].i < e ? b->r[r + 1].i : e;
+        e = k + 1 < b->nk && b->k[k + 1].i < e ? b->k[k + 1].i : e;
+        if (b->nr > 0) {
+            rColor(b->r[r].rgb);
+        }
+        rBufTris(&b->g, b->k[k].v, i, e - i);
+        i = e;
+    }
 }
 
-void batchAny(Batch*b,size_t ni,const uint32_t*i,size_t nv,const RVertex*v) {
+void batchReserve(Batch *b, size_t ni, size_t nv) {
     if (b->mi < b->ni + ni) {
         if (b->mi == 0) {
             b->mi = 1;
@@ -34,10 +86,6 @@ void batchAny(Batch*b,size_t ni,const uint32_t*i,size_t nv,const RVertex*v) {
         }
         b->i = realloc(b->i, b->mi * sizeof(*b->i));
     }
-    if (i != NULL) {
-        memcpy(b->i + b->ni, i, ni * sizeof(*i));
-        b->ni += ni;
-    }
 
     if (b->mv < b->nv + nv) {
         if (b->mv == 0) {
@@ -48,19 +96,79 @@ void batchAny(Batch*b,size_t ni,const uint32_t*i,size_t nv,const RVertex*v) {
         }
         b->v = realloc(b->v, b->mv * sizeof(*b->v));
     }
+}
+
+// Indices added from now on are drawn in rgb; the first run of a batch also
+// takes those added before it. A run that got no indices is recoloured
+// rather than followed.
+void batchColor(Batch *b, const uint8_t *rgb) {
+    BatchRun *r = b->nr ? b->r + b->nr - 1 : NULL;
+    if (r && memcmp(r->rgb, rgb, 3) == 0) {
+        return;
+    }
+    if (r && r->i == b->ni && b->nr > 1 && memcmp(r[-1].rgb, rgb, 3) == 0) {
+        --b->nr;
+        return;
+    }
+    if (r && r->i == b->ni) {
+        memcpy(r->rgb, rgb, 3);
+        return;
+    }
+    if (b->nr >= b->mr) {
+        b->mr = b->mr ? b->mr * 2 : 16;
+        b->r = realloc(b->r, b->mr * sizeof(*b->r));
+    }
+    b->r[b->nr] = (BatchRun){b->nr ? b->ni : 0, {rgb[0], rgb[1], rgb[2]}};
+    ++b->nr;
+}
+
+// Appends ni indices and nv vertices left for the caller to fill in through
+// *i and *v, which stay valid until the batch grows again. Indices count
+// from the start of the chunk the vertices fall in; the one *v points to is
+// returned. A new chunk starts when the vertices would not fit in CV, and
+// still covers the last CO vertices before it, so a strip can join them.
+uint16_t batchEmplace(Batch*b,size_t ni,size_t nv,uint16_t**i,RVertex**v) {
+    BatchChunk *k = b->nk ? b->k + b->nk - 1 : NULL;
+    if (k == NULL || b->nv + nv - k->v > CV) {
+        if (b->nk >= b->mk) {
+            b->mk = b->mk ? b->mk * 2 : 4;
+            b->k = realloc(b->k, b->mk * sizeof(*b->k));
+        }
+        b->k[b->nk] = (BatchChunk){b->ni, b->nk ? b->nv - CO : 0};
+        k = b->k + b->nk++;
+    }
+    batchReserve(b, ni, nv);
+    *i = b->i + b->ni;
+    *v = b->v + b->nv;
+    uint16_t f = b->nv - k->v;
+    b->ni += ni;
+    b->nv += nv;
+    return f;
+}
+
+// The indices i count from the first of the vertices v.
+void batchAny(Batch*b,size_t ni,const uint16_t*i,size_t nv,const RVertex*v) {
+    uint16_t *bi;
+    RVertex *bv;
+    uint16_t f = batchEmplace(b, i ? ni : 0, v ? nv : 0, &bi, &bv);
+    for (size_t j = 0; i != NULL && j < ni; ++j) {
+        bi[j] = f + i[j];
+    }
     if (v != NULL) {
-        memcpy(b->v + b->nv, v, nv * sizeof(*v));
-        b->nv += nv;
+        memcpy(bv, v, nv * sizeof(*v));
     }
 }
 
 void batchRect(Batch *b, const float *xywh, const uint8_t *rgb) {
-    RVertex v0 = {xywh[0],           xywh[1],           rgb[0], rgb[1], rgb[2]};
-    RVertex v1 = {xywh[0] + xywh[2], xywh[1],           rgb[0], rgb[1], rgb[2]};
-    RVertex v2 = {xywh[0] + xywh[2], xywh[1] + xywh[3], rgb[0], rgb[1], rgb[2]};
-    RVertex v3 = {xywh[0],           xywh[1] + xywh[3], rgb[0], rgb[1], rgb[2]};
-    uint32_t i[] = {b->nv+0,b->nv+1,b->nv+2,b->nv+2,b->nv+3,b->nv+0};
-    batchAny(b, 6, i, 4, (RVertex[]){v0, v1, v2, v3});
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, rgb);
+    uint16_t f = batchEmplace(b, 6, 4, &i, &v);
+    v[0] = (RVertex){xywh[0],           xywh[1]};
+    v[1] = (RVertex){xywh[0] + xywh[2], xywh[1]};
+    v[2] = (RVertex){xywh[0] + xywh[2], xywh[1] + xywh[3]};
+    v[3] = (RVertex){xywh[0],           xywh[1] + xywh[3]};
+    quadIndices(i, f);
 }
 
 void batchRectLine(Batch*b,const float*xywh,float ti,float to,const uint8_t*rgb){
@@ -75,112 +183,161 @@ void batchLine(Batch*b,float x,float y,float a,float l,float t,const uint8_t*rgb
     float dy = cosf(a) * t / 2;
     float X = x + cosf(a) * l;
     float Y = y + sinf(a) * l;
-    uint32_t i[] = {b->nv+0,b->nv+1,b->nv+2,b->nv+2,b->nv+3,b->nv+0};
-    RVertex v0 = {x - dx, y + dy, rgb[0], rgb[1], rgb[2]};
-    RVertex v1 = {x + dx, y - dy, rgb[0], rgb[1], rgb[2]};
-    RVertex v2 = {X + dx, Y - dy, rgb[0], rgb[1], rgb[2]};
-    RVertex v3 = {X - dx, Y + dy, rgb[0], rgb[1], rgb[2]};
-    batchAny(b, 6, i, 4, (RVertex[]){v0, v1, v2, v3});
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, rgb);
+    uint16_t f = batchEmplace(b, 6, 4, &i, &v);
+    v[0] = (RVertex){x - dx, y + dy};
+    v[1] = (RVertex){x + dx, y - dy};
+    v[2] = (RVertex){X + dx, Y - dy};
+    v[3] = (RVertex){X - dx, Y + dy};
+    quadIndices(i, f);
 }
 
 void batchCircle(Batch*b,float x,float y,float r,float o,size_t n,const uint8_t*rgb) {
-    uint32_t *i = malloc(n * 3 * sizeof(*i));
-    RVertex *v = malloc((n + 1) * sizeof(*v));
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, rgb);
+    uint16_t f = batchEmplace(b, n * 3, n + 1, &i, &v);
+
+    fanIndices(i, f, n - 1);
+    i[n * 3 - 3] = f + 0;
+    i[n * 3 - 2] = f + n;
+    i[n * 3 - 1] = f + 1;
+
+    v[0] = (RVertex){x, y};
+    arcVertices(v + 1, 1, x, y, r, o, getTab(n, PI * 2 / n));
+}
 
-    for (size_t j = 0; j < n - 1; ++j) {
-        i[j * 3 + 0] = b->nv + 0;
-        i[j * 3 + 1] = b->nv + j + 1;
-        i[j * 3 + 2] = b->nv + j + 2;
-    }
-    i[n * 3 - 3] = b->nv + 0;
-    i[n * 3 - 2] = b->nv + n;
-    i[n * 3 - 1] = b->nv + 1;
+void batchPieSlice(Batch*b,float x,float y,float r,float o,float a,size_t n,const uint8_t*rgb){
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, rgb);
+    uint16_t f = batchEmplace(b, (n - 1) * 3, n + 1, &i, &v);
 
-    float da = PI * 2 / n;
-    v[0] = (RVertex){x, y, rgb[0], rgb[1], rgb[2]};
-    for (size_t j = 0; j < n; ++j) {
-        v[j + 1] = (RVertex){x + cosf(da * j + o) * r, y + sinf(da * j + o) * r, rgb[0], rgb[1], rgb[2]};
-    }
+    fanIndices(i, f, n - 1);
 
-    batchAny(b, n * 3, i, n + 1, v);
+    v[0] = (RVertex){x, y};
+    arcVertices(v + 1, 1, x, y, r, o, getTab(n, a / (n - 1)));
 }
 
-void batchPieSlice(Batch*b,float x,float y,float r,float o,float a,size_t n,const uint8_t*rgb){
-    uint32_t *i = malloc((n - 1) * 3 * sizeof(*i));
-    RVertex *v = malloc((n + 1) * sizeof(*v));
+void batchRing(Batch*b,float x,float y,float r,float t,float o,size_t n,const uint8_t*rgb){
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, rgb);
+    uint16_t f = batchEmplace(b, n * 6, n * 2, &i, &v);
+
+    stripIndices(i, f, n - 1);
+    i[n * 6 - 6] = f + n * 2 - 2;
+    i[n * 6 - 5] = f + n * 2 - 1;
+    i[n * 6 - 4] = f + 0;
+    i[n * 6 - 3] = f + 0;
+    i[n * 6 - 2] = f + 1;
+    i[n * 6 - 1] = f + n * 2 - 1;
+
+    const Tab *tb = getTab(n, PI * 2 / n);
+    arcVertices(v + 0, 2, x, y, r - t / 2, o, tb);
+    arcVertices(v + 1, 2, x, y, r + t / 2, o, tb);
+}
 
-    for (size_t j = 0; j < n - 1; ++j) {
-        i[j * 3 + 0] = b->nv + 0;
-        i[j * 3 + 1] = b->nv + j + 1;
-        i[j * 3 + 2] = b->nv + j + 2;
-    }
+void batchRingSlice(Batch*b,float x,float y,float r,float t,float o,float a,size_t n,const uint8_t*rgb){
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, rgb);
+    uint16_t f = batchEmplace(b, (n - 1) * 6, n * 2, &i, &v);
 
-    float da = a / (n - 1);
-    v[0] = (RVertex){x, y, rgb[0], rgb[1], rgb[2]};
-    for (size_t j = 0; j < n; ++j) {
-        v[j + 1] = (RVertex){x + cosf(da * j + o) * r, y + sinf(da * j + o) * r, rgb[0], rgb[1], rgb[2]};
-    }
+    stripIndices(i, f, n - 1);
 
-    batchAny(b, (n - 1) * 3, i, n + 1, v);
+    const Tab *tb = getTab(n, a / (n - 1));
+    arcVertices(v + 0, 2, x, y, r - t / 2, o, tb);
+    arcVertices(v + 1, 2, x, y, r + t / 2, o, tb);
 }
 
-void batchRing(Batch*b,float x,float y,float r,float t,float o,size_t n,const uint8_t*rgb){
-    uint32_t *i = malloc(n * 6 * sizeof(*i));
-    RVertex *v = malloc(n * 2 * sizeof(*v));
-
-    for (size_t j = 0; j < n - 1; ++j) {
-        i[j * 6 + 0] = b->nv + j * 2 + 0;
-        i[j * 6 + 1] = b->nv + j * 2 + 1;
-        i[j * 6 + 2] = b->nv + j * 2 + 3;
-        i[j * 6 + 3] = b->nv + j * 2 + 3;
-        i[j * 6 + 4] = b->nv + j * 2 + 2;
-        i[j * 6 + 5] = b->nv + j * 2 + 0;
-    }
-    i[n * 6 - 6] = b->nv + n * 2 - 2;
-    i[n * 6 - 5] = b->nv + n * 2 - 1;
-    i[n * 6 - 4] = b->nv + 0;
-    i[n * 6 - 3] = b->nv + 0;
-    i[n * 6 - 2] = b->nv + 1;
-    i[n * 6 - 1] = b->nv + n * 2 - 1;
-
-    float da = PI * 2 / n;
-    float r0 = r - t / 2;
-    float r1 = r + t / 2;
+static void quadIndices(uint16_t *i, uint16_t f) {
+    i[0] = f + 0;
+    i[1] = f + 1;
+    i[2] = f + 2;
+    i[3] = f + 2;
+    i[4] = f + 3;
+    i[5] = f + 0;
+}
+
+// n triangles fanning out from vertex f over the vertices after it.
+static void fanIndices(uint16_t *i, uint16_t f, size_t n) {
     for (size_t j = 0; j < n; ++j) {
-        v[j * 2 + 0] = (RVertex){x + cosf(da * j + o) * r0, y + sinf(da * j + o) * r0, rgb[0], rgb[1], rgb[2]};
-        v[j * 2 + 1] = (RVertex){x + cosf(da * j + o) * r1, y + sinf(da * j + o) * r1, rgb[0], rgb[1], rgb[2]};
+        i[j * 3 + 0] = f + 0;
+        i[j * 3 + 1] = f + j + 1;
+        i[j * 3 + 2] = f + j + 2;
     }
-
-    batchAny(b, n * 6, i, n * 2, v);
 }
 
-void batchRingSlice(Batch*b,float x,float y,float r,float t,float o,float a,size_t n,const uint8_t*rgb){
-    uint32_t *i = malloc((n - 1) * 6 * sizeof(*i));
-    RVertex *v = malloc(n * 2 * sizeof(*v));
+// n quads between pairs of inner and outer vertices starting at vertex f.
+static void stripIndices(uint16_t *i, uint16_t f, size_t n) {
+    for (size_t j = 0; j < n; ++j) {
+        i[j * 6 + 0] = f + j * 2 + 0;
+        i[j * 6 + 1] = f + j * 2 + 1;
+        i[j * 6 + 2] = f + j * 2 + 3;
+        i[j * 6 + 3] = f + j * 2 + 3;
+        i[j * 6 + 4] = f + j * 2 + 2;
+        i[j * 6 + 5] = f + j * 2 + 0;
+    }
+}
 
-    for (size_t j = 0; j < n - 1; ++j) {
-        i[j * 6 + 0] = b->nv + j * 2 + 0;
-        i[j * 6 + 1] = b->nv + j * 2 + 1;
-        i[j * 6 + 2] = b->nv + j * 2 + 3;
-        i[j * 6 + 3] = b->nv + j * 2 + 3;
-        i[j * 6 + 4] = b->nv + j * 2 + 2;
-        i[j * 6 + 5] = b->nv + j * 2 + 0;
+// Tables are looked up by count and step, so the fixed qualities of whole
+// circles and quarter rings hit the cache every frame; other steps, like
+// those of animated slices, replace the least recently used table.
+static const Tab *getTab(size_t n, float da) {
+    Tab *t = tab;
+    for (size_t k = 0; k < TABN; ++k) {
+        if (tab[k].n == n && tab[k].da == da) {
+            tab[k].used = ++tabClock;
+            return tab + k;
+        }
+        t = tab[k].used < t->used ? tab + k : t;
     }
 
-    float da = a / (n - 1);
-    float r0 = r - t / 2;
-    float r1 = r + t / 2;
+    t->used = ++tabClock;
+    if (t->n < n) {
+        t->c = realloc(t->c, n * sizeof(*t->c));
+        t->s = realloc(t->s, n * sizeof(*t->s));
+    }
+    t->n = n;
+    t->da = da;
     for (size_t j = 0; j < n; ++j) {
-        v[j * 2 + 0] = (RVertex){x + cosf(da * j + o) * r0, y + sinf(da * j + o) * r0, rgb[0], rgb[1], rgb[2]};
-        v[j * 2 + 1] = (RVertex){x + cosf(da * j + o) * r1, y + sinf(da * j + o) * r1, rgb[0], rgb[1], rgb[2]};
+        t->c[j] = cosf(da * j);
+        t->s[j] = sinf(da * j);
     }
+    return t;
+}
 
-    batchAny(b, (n - 1) * 6, i, n * 2, v);
+// Writes t->n points of radius r around (x, y), every step-th vertex from v.
+// The offset o is one 2x2 rotation of the table, leaving a loop of plain
+// multiply-adds.
+static void arcVertices(RVertex*restrict v,size_t step,float x,float y,float r,float o,const Tab*t){
+    const float *restrict c = t->c;
+    const float *restrict s = t->s;
+    float rc = cosf(o) * r;
+    float rs = sinf(o) * r;
+    for (size_t j = 0; j < t->n; ++j) {
+        v[j * step].x = x + c[j] * rc - s[j] * rs;
+        v[j * step].y = y + c[j] * rs + s[j] * rc;
+    }
 }
 
+// Removes the last ni indices and nv vertices. A chunk goes only once both
+// its indices and its own vertices have, since a caller may take back the
+// vertices of a section while keeping the indices that join it.
 void batchClearAny(Batch*b,size_t ni,size_t nv) {
     b->ni -= ni;
     b->nv -= nv;
+    b->gi = b->gi < b->ni ? b->gi : b->ni;
+    b->gv = b->gv < b->nv ? b->gv : b->nv;
+    while (b->nr > 1 && b->r[b->nr - 1].i >= b->ni) {
+        --b->nr;
+    }
+    while (b->nk > 1 && b->k[b->nk - 1].i >= b->ni && b->k[b->nk - 1].v + CO >= b->nv) {
+        --b->nk;
+    }
 }
 
 void batchClearRect(Batch *b) {
@@ -3,25 +3,52 @@
 
 typedef struct {
     float x, y;
-    uint8_t r, g, b;
 } RVertex;
+enum {RSTREAM, RDYNAMIC, RSTATIC};
+typedef struct {
+    unsigned vbo, ibo;
+    size_t mi, mv;
+    int use;
+} RBuf;
 void rInit(void);
 void rExit(void);
 void rPipe(float mulX, float mulY, float addX, float addY);
-void rTris(size_t ni, const uint32_t *i, const RVertex *v);
+void rMat(const float *m);
+void rColor(const uint8_t *rgb);
+void rTris(size_t ni, const uint16_t *i, const RVertex *v);
 void rClear(uint8_t r, uint8_t g, uint8_t b);
 void rViewport(int x, int y, int w, int h);
+void rRead(int x, int y, int w, int h, uint8_t *rgba);
+RBuf rBufNew(int use);
+void rBufDel(RBuf *b);
+void rBufData(RBuf*b,size_t oi,size_t ni,const uint16_t*i,size_t ov,size_t nv,const RVertex*v);
+void rBufTris(const RBuf *b, size_t ov, size_t oi, size_t ni);
 
 typedef struct {
-    size_t ni, mi, nv, mv;
-    uint32_t *i;
+    size_t i; // First index drawn in rgb
+    uint8_t rgb[3];
+} BatchRun;
+typedef struct {
+    size_t i; // First index of the chunk
+    size_t v; // Vertex its indices count from
+} BatchChunk;
+typedef struct {
+    size_t ni, mi, nv, mv, nr, mr, nk, mk;
+    uint16_t *i;
     RVertex *v;
+    BatchRun *r;
+    BatchChunk *k;
+    RBuf g;
+    size_t gi, gv;
 } Batch;
-Batch batchNew(void);
+Batch batchNew(int use);
 void batchDel(Batch *b);
 void batchClear(Batch *b);
-void batchDraw(const Batch *b);
-void batchAny(Batch*b,size_t ni,const uint32_t*i,size_t nv,const RVertex*v);
+void batchDraw(Batch *b);
+void batchReserve(Batch *b, size_t ni, size_t nv);
+void batchColor(Batch *b, const uint8_t *rgb);
+uint16_t batchEmplace(Batch*b,size_t ni,size_t nv,uint16_t**i,RVertex**v);
+void batchAny(Batch*b,size_t ni,const uint16_t*i,size_t nv,const RVertex*v);
 void batchRect(Batch *b, const float *xywh, const uint8_t*rgb);
 void batchRectLine(Batch*b,const float*xywh,float ti,float to,const uint8_t*rgb);
 void batchLine(Batch*b,float x,float y,float a,float l,float t,const uint8_t*rgb);
@@ -43,3 +70,25 @@ void matTrans(float *m, float x, float y);
 void matRot(float *m, float a);
 void matMul(float *m, const float *a, const float *b);
 void matMulVec(float *mv, const float *m, const float *v);
+
+void recInit(const char *prefix, int w, int h);
+void recExit(void);
+void recFrame(void);
+
+// PROF(i) stmt times stmt as stage i. Building with -DNPROF compiles the
+// profiler out.
+#ifndef NPROF
+#define PROF(i) for (int prof = (profBegin(i), 1); prof; prof = (profEnd(i), 0))
+void profInit(size_t n, const char *const *names, const char *trace);
+void profExit(void);
+void profBegin(size_t i);
+void profEnd(size_t i);
+void profFrame(void);
+void profBatch(Batch *b, const float *xywh);
+#else
+#define PROF(i)
+static inline void profInit(size_t n, const char *const *names, const char *trace) {(void)n; (void)names; (void)trace;}
+static inline void profExit(void) {}
+static inline void profFrame(void) {}
+static inline void profBatch(Batch *b, const float *xywh) {(void)b; (void)xywh;}
+#endif
@@ -0,0 +1,144 @@
+#include "lib.h"
+
+#ifndef NPROF
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+#define MAX(x,y) ((x)>(y)?(x):(y))
+
+#define PF 256 // Frames kept for the overlay
+#define PS 8 // Maximum number of Stages
+#define HB 40 // Histogram Buckets
+#define HW 1.0 // Histogram bucket Width, in milliseconds
+#define GT (1.0 / 30) // Graph Top, in seconds
+
+#define BC (const uint8_t[]){0, 0, 0} // Background Color
+#define GC (const uint8_t[]){64, 64, 64} // Graph Color, time outside stages
+#define LC (const uint8_t[]){255, 255, 255} // Line Color, at 60 fps
+#define HC (const uint8_t[]){128, 192, 255} // Histogram Color
+
+static const uint8_t SC[PS][3] = { // Stage Colors
+    {255, 96, 96}, {96, 255, 96}, {96, 96, 255}, {255, 255, 96},
+    {255, 96, 255}, {96, 255, 255}, {255, 160, 64}, {160, 64, 255},
+};
+
+static struct {
+    size_t n, f, open, outer[PS]; // Innermost stage begun, PS if none, and what each interrupted
+    const char *const *names;
+    double t0, begin[PS], dur[PF][PS], frame[PF];
+    FILE *trace;
+    bool comma;
+} p;
+
+static void event(const char *name, double t, double dt);
+static double now(void);
+
+// names[i] names stage i < n. With trace set, every stage and frame is also
+// written there as a Chrome trace event.
+void profInit(size_t n, const char *const *names, const char *trace) {
+    memset(&p, 0, sizeof(p));
+    p.n = n < PS ? n : PS;
+    p.names = names;
+    p.open = PS;
+    p.t0 = now();
+    p.trace = trace ? fopen(trace, "w") : NULL;
+    if (trace && !p.trace) {
+        perror(trace);
+    }
+    if (p.trace) {
+        fputs("[\n", p.trace);
+    }
+}
+
+void profExit(void) {
+    if (p.trace) {
+        fputs("\n]\n", p.trace);
+        fclose(p.trace);
+    }
+    memset(&p, 0, sizeof(p));
+}
+
+void profBegin(size_t i) {
+    p.outer[i] = p.open;
+    p.open = i;
+    p.begin[i] = now();
+}
+
+// A stage may run several times a frame; its times add up. A stage begun
+// inside another is taken out of the time of the other, so the stacked bars
+// of the overlay never count it twice.
+void profEnd(size_t i) {
+    double t = now();
+    p.dur[p.f % PF][i] += t - p.begin[i];
+    if (p.outer[i] < PS) {
+        p.dur[p.f % PF][p.outer[i]] -= t - p.begin[i];
+    }
+    p.open = p.outer[i];
+    event(p.names[i], p.begin[i], t - p.begin[i]);
+}
+
+void profFrame(void) {
+    double t = now();
+    p.frame[p.f % PF] = t - p.t0;
+    event("frame", p.t0, t - p.t0);
+    p.t0 = t;
+    ++p.f;
+    memset(p.dur[p.f % PF], 0, sizeof(p.dur[0]));
+}
+
+// The upper half of xywh shows the last PF frames as bars stacked by stage,
+// GT high, with a line at 60 fps; the lower half is the histogram of their
+// frame times in HW millisecond buckets. Rects are added colour by colour,
+// so that the batch draws them in few runs.
+void profBatch(Batch *b, const float *xywh) {
+    size_t nf = p.f < PF ? p.f : PF;
+    float x = xywh[0], y = xywh[1], w = xywh[2], h = xywh[3] / 2;
+    float bw = w / PF;
+    float by[PF], fh[PF];
+    size_t hist[HB] = {0}, hmax = 1;
+
+    batchRect(b, xywh, BC);
+    for (size_t k = 0; k < nf; ++k) {
+        size_t f = (p.f - nf + k) % PF;
+        by[k] = y + h;
+        fh[k] = MIN(p.frame[f] / GT, 1) * h;
+        batchRect(b, (const float[]){x + bw * k, by[k], bw, fh[k]}, GC);
+
+        size_t j = MIN(p.frame[f] * 1000 / HW, HB - 1);
+        hmax = MAX(hmax, ++hist[j]);
+    }
+    for (size_t i = 0; i < p.n; ++i) {
+        for (size_t k = 0; k < nf; ++k) {
+            size_t f = (p.f - nf + k) % PF;
+            float sh = MIN(p.dur[f][i] / GT * h, y + h + fh[k] - by[k]);
+            batchRect(b, (const float[]){x + bw * k, by[k], bw, sh}, SC[i]);
+            by[k] += sh;
+        }
+    }
+    batchRect(b, (const float[]){x, y + h + h / 60 / GT, w, h / 200}, LC);
+
+    for (size_t j = 0; j < HB; ++j) {
+        batchRect(b, (const float[]){x + w / HB * j, y, w / HB * 0.8F, h * hist[j] / hmax}, HC);
+    }
+}
+
+static void event(const char *name, double t, double dt) {
+    if (!p.trace) {
+        return;
+    }
+    fprintf(p.trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+            p.comma ? ",\n" : "", name, t * 1e6, dt * 1e6);
+    p.comma = true;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+#endif
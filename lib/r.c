@@ -3,7 +3,8 @@
 #include <GLES2/gl2.h>
 
 static struct {
-    GLuint prog, aPos, aClr, uMul, uAdd;
+    GLuint prog, aPos, uMat, uMul, uAdd, uClr;
+    RBuf stream;
 } r;
 
 static GLuint mkShd(const char *vertSrc, const char *fragSrc);
@@ -12,34 +13,40 @@ void rInit(void) {
     const char *VERT =
     "#version 100\n"
     "attribute vec2 aPos;\n"
-    "attribute vec3 aClr;\n"
-    "varying vec3 vClr;\n"
+    "uniform mat3 uMat;\n"
     "uniform vec2 uMul, uAdd;\n"
     "void main(void) {\n"
-    "    gl_Position = vec4(aPos * uMul + uAdd, 0, 1);\n"
-    "    vClr = aClr / 255.0;\n"
+    "    gl_Position = vec4((uMat * vec3(aPos, 1)).xy * uMul + uAdd, 0, 1);\n"
     "}\n";
 
     const char *FRAG =
     "#version 100\n"
     "precision mediump float;\n"
-    "varying vec3 vClr;\n"
+    "uniform vec3 uClr;\n"
     "void main(void) {\n"
-    "    gl_FragColor = vec4(vClr.rgb, 1);\n"
+    "    gl_FragColor = vec4(uClr, 1);\n"
     "}\n";
 
     r.prog = mkShd(VERT, FRAG);
     glUseProgram(r.prog);
 
     r.aPos = glGetAttribLocation(r.prog, "aPos");
-    r.aClr = glGetAttribLocation(r.prog, "aClr");
+    r.uMat = glGetUniformLocation(r.prog, "uMat");
     r.uMul = glGetUniformLocation(r.prog, "uMul");
     r.uAdd = glGetUniformLocation(r.prog, "uAdd");
+    r.uClr = glGetUniformLocation(r.prog, "uClr");
+
+    glEnableVertexAttribArray(r.aPos);
 
     rPipe(1, 1, 0, 0);
+    rMat(NULL);
+    rColor((const uint8_t[]){255, 255, 255});
+    r.stream = rBufNew(RSTREAM);
 }
 
 void rExit(void) {
+    rBufDel(&r.stream);
+    glDisableVertexAttribArray(r.aPos);
     glDeleteProgram(r.prog);
 }
 
@@ -48,17 +55,23 @@ void rPipe(float mulX, float mulY, float addX, float addY) {
     glUniform2f(r.uAdd, addX, addY);
 }
 
-void rTris(size_t ni, const uint32_t *i, const RVertex *v) {
-    glEnableVertexAttribArray(r.aPos);
-    glEnableVertexAttribArray(r.aClr);
-
-    glVertexAttribPointer(r.aPos, 2, GL_FLOAT, GL_FALSE, sizeof(*v), &v->x);
-    glVertexAttribPointer(r.aClr,3,GL_UNSIGNED_BYTE,GL_FALSE,sizeof(*v),&v->r);
+void rMat(const float *m) {
+    const float I[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    glUniformMatrix3fv(r.uMat, 1, GL_FALSE, m ? m : I);
+}
 
-    glDrawElements(GL_TRIANGLES, ni, GL_UNSIGNED_INT, i);
+// Colour of the triangles drawn from now on.
+void rColor(const uint8_t *rgb) {
+    glUniform3f(r.uClr, rgb[0] / 255.0f, rgb[1] / 255.0f, rgb[2] / 255.0f);
+}
 
-    glDisableVertexAttribArray(r.aClr);
-    glDisableVertexAttribArray(r.aPos);
+void rTris(size_t ni, const uint16_t *i, const RVertex *v) {
+    size_t nv = 0;
+    for (size_t j = 0; j < ni; ++j) {
+        nv = i[j] >= nv ? i[j] + 1U : nv;
+    }
+    rBufData(&r.stream, 0, ni, i, 0, nv, v);
+    rBufTris(&r.stream, 0, 0, ni);
 }
 
 void rClear(uint8_t r, uint8_t g, uint8_t b) {
@@ -70,6 +83,69 @@ void rViewport(int x, int y, int w, int h) {
     glViewport(x, y, w, h);
 }
 
+// Reads back w x h pixels from (x, y), as RGBA rows bottom up. Waits for
+// what was drawn before.
+void rRead(int x, int y, int w, int h, uint8_t *rgba) {
+    glReadPixels(x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+}
+
+RBuf rBufNew(int use) {
+    RBuf b = {0, 0, 0, 0, use};
+    glGenBuffers(1, &b.vbo);
+    glGenBuffers(1, &b.ibo);
+    return b;
+}
+
+void rBufDel(RBuf *b) {
+    glDeleteBuffers(1, &b->ibo);
+    glDeleteBuffers(1, &b->vbo);
+    b->vbo = b->ibo = 0;
+    b->mi = b->mv = 0;
+}
+
+// Uploads ni indices at index oi and nv vertices at vertex ov. Storage grows
+// to fit, losing what it held. A stream buffer written from its start is
+// orphaned first, so the driver need not wait for draws still reading it.
+void rBufData(RBuf*b,size_t oi,size_t ni,const uint16_t*i,size_t ov,size_t nv,const RVertex*v){
+    GLenum use = b->use == RSTATIC ? GL_STATIC_DRAW
+               : b->use == RDYNAMIC ? GL_DYNAMIC_DRAW
+               : GL_STREAM_DRAW;
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->ibo);
+    if (b->mi < oi + ni) {
+        b->mi = b->mi * 2 < oi + ni ? oi + ni : b->mi * 2;
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, b->mi * sizeof(*i), NULL, use);
+    } else if (b->use == RSTREAM && oi == 0) {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, b->mi * sizeof(*i), NULL, use);
+    }
+    if (ni > 0) {
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, oi*sizeof(*i), ni*sizeof(*i), i);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+    if (b->mv < ov + nv) {
+        b->mv = b->mv * 2 < ov + nv ? ov + nv : b->mv * 2;
+        glBufferData(GL_ARRAY_BUFFER, b->mv * sizeof(*v), NULL, use);
+    } else if (b->use == RSTREAM && ov == 0) {
+        glBufferData(GL_ARRAY_BUFFER, b->mv * sizeof(*v), NULL, use);
+    }
+    if (nv > 0) {
+        glBufferSubData(GL_ARRAY_BUFFER, ov * sizeof(*v), nv * sizeof(*v), v);
+    }
+}
+
+// Draws the ni indices from index oi, which count vertices from vertex ov.
+// 16 bit indices are all core GLES 2.0 guarantees, so a buffer holding more
+// vertices is drawn in windows of them.
+void rBufTris(const RBuf *b, size_t ov, size_t oi, size_t ni) {
+    glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->ibo);
+
+    glVertexAttribPointer(r.aPos, 2, GL_FLOAT, GL_FALSE, sizeof(RVertex), (const void *)(ov * sizeof(RVertex)));
+
+    glDrawElements(GL_TRIANGLES, ni, GL_UNSIGNED_SHORT, (const void *)(oi * sizeof(uint16_t)));
+}
+
 static GLuint mkShd(const char *vertSrc, const char *fragSrc) {
     GLuint prog = glCreateProgram();
     GLuint vert = glCreateShader(GL_VERTEX_SHADER);
@@ -0,0 +1,112 @@
+#include "lib.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define RQ 4 // Recorded frames Queued for the writer, at most
+
+static struct {
+    pthread_t t;
+    pthread_mutex_t mu;
+    pthread_cond_t full, free;
+    const char *prefix;
+    int w, h;
+    size_t head, tail; // Next frame read back, next frame written
+    bool quit;
+    uint8_t *px[RQ];
+} q = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, false, {NULL}};
+
+static void *writer(void *arg);
+static void writePpm(size_t f, const uint8_t *px, uint8_t *row);
+
+// Frame f of the w x h frames recorded is written to prefix, then f on six
+// digits, then ".ppm". A writer thread encodes them, so the render loop only
+// waits on it when RQ frames are already queued.
+void recInit(const char *prefix, int w, int h) {
+    q.prefix = prefix;
+    q.w = w;
+    q.h = h;
+    q.head = q.tail = 0;
+    q.quit = false;
+    for (size_t k = 0; k < RQ; ++k) {
+        q.px[k] = malloc((size_t)w * h * 4);
+    }
+    pthread_create(&q.t, NULL, writer, NULL);
+}
+
+// Writes the frames still queued.
+void recExit(void) {
+    pthread_mutex_lock(&q.mu);
+    q.quit = true;
+    pthread_cond_signal(&q.full);
+    pthread_mutex_unlock(&q.mu);
+    pthread_join(q.t, NULL);
+    for (size_t k = 0; k < RQ; ++k) {
+        free(q.px[k]);
+    }
+}
+
+// Reads back the frame just drawn and queues it. The writer never touches
+// the slot of q.head, so only the queue bookkeeping is locked.
+void recFrame(void) {
+    pthread_mutex_lock(&q.mu);
+    while (q.head - q.tail >= RQ) {
+        pthread_cond_wait(&q.free, &q.mu);
+    }
+    pthread_mutex_unlock(&q.mu);
+
+    rRead(0, 0, q.w, q.h, q.px[q.head % RQ]);
+
+    pthread_mutex_lock(&q.mu);
+    ++q.head;
+    pthread_cond_signal(&q.full);
+    pthread_mutex_unlock(&q.mu);
+}
+
+static void *writer(void *arg) {
+    uint8_t *row = malloc((size_t)q.w * 3);
+    (void)arg;
+
+    pthread_mutex_lock(&q.mu);
+    while (true) {
+        while (q.tail == q.head && !q.quit) {
+            pthread_cond_wait(&q.full, &q.mu);
+        }
+        if (q.tail == q.head) {
+            break;
+        }
+        size_t f = q.tail;
+        pthread_mutex_unlock(&q.mu);
+        writePpm(f, q.px[f % RQ], row);
+        pthread_mutex_lock(&q.mu);
+        ++q.tail;
+        pthread_cond_signal(&q.free);
+    }
+    pthread_mutex_unlock(&q.mu);
+
+    free(row);
+    return NULL;
+}
+
+// px holds RGBA rows bottom up, as read back; PPM wants RGB rows top down.
+static void writePpm(size_t f, const uint8_t *px, uint8_t *row) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s%06zu.ppm", q.prefix, f);
+    FILE *o = fopen(path, "wb");
+    if (!o) {
+        perror(path);
+        return;
+    }
+    fprintf(o, "P6\n%d %d\n255\n", q.w, q.h);
+    for (int y = q.h - 1; y >= 0; --y) {
+        const uint8_t *p = px + (size_t)y * q.w * 4;
+        for (int x = 0; x < q.w; ++x) {
+            memcpy(row + x * 3, p + x * 4, 3);
+        }
+        fwrite(row, 3, q.w, o);
+    }
+    fclose(o);
+}
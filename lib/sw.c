@@ -0,0 +1,445 @@
+#include "lib.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VW 8 // Vector Width, in floats
+typedef __m256 V;
+#define V1(x) _mm256_set1_ps(x)
+#define VSTEP _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)
+#define VADD(a,b) _mm256_add_ps(a,b)
+#define VSUB(a,b) _mm256_sub_ps(a,b)
+#define VMUL(a,b) _mm256_mul_ps(a,b)
+#define VAND(a,b) _mm256_and_ps(a,b)
+#define VLT(a,b) _mm256_cmp_ps(a,b,_CMP_LT_OQ)
+#define VLE(a,b) _mm256_cmp_ps(a,b,_CMP_LE_OQ)
+#define VMASK(x) _mm256_movemask_ps(x)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VW 4
+typedef __m128 V;
+#define V1(x) _mm_set1_ps(x)
+#define VSTEP _mm_setr_ps(0, 1, 2, 3)
+#define VADD(a,b) _mm_add_ps(a,b)
+#define VSUB(a,b) _mm_sub_ps(a,b)
+#define VMUL(a,b) _mm_mul_ps(a,b)
+#define VAND(a,b) _mm_and_ps(a,b)
+#define VLT(a,b) _mm_cmplt_ps(a,b)
+#define VLE(a,b) _mm_cmple_ps(a,b)
+#define VMASK(x) _mm_movemask_ps(x)
+#else
+#define VW 1
+typedef float V;
+#define V1(x) (x)
+#define VSTEP 0.0F
+#define VADD(a,b) ((a)+(b))
+#define VSUB(a,b) ((a)-(b))
+#define VMUL(a,b) ((a)*(b))
+#define VAND(a,b) ((a)!=0&&(b)!=0)
+#define VLT(a,b) ((a)<(b))
+#define VLE(a,b) ((a)<=(b))
+#define VMASK(x) ((x)!=0)
+#endif
+
+#define TS 64 // Tile Size, in pixels
+#define SP 256 // Sub-Pixel positions vertices snap to, as on the GPU
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+#define MAX(x,y) ((x)>(y)?(x):(y))
+
+// A triangle in window coordinates. Edge k covers the pixels whose centre p
+// has s[k] * ((dx, dy) x (p - a)) > 0, or = 0 if own[k]. An edge shared by
+// two triangles is taken from its lower end in both, so their edge values
+// are bit for bit opposite and they neither overlap nor leave gaps.
+typedef struct {
+    float ax[3], ay[3], dx[3], dy[3], s[3];
+    bool own[3];
+    uint32_t c;
+    int x0, y0, x1, y1; // Pixels it may cover, clipped to the viewport
+} Tri;
+
+typedef struct {
+    size_t n, m;
+    uint32_t *t;
+} Bin;
+
+typedef struct {
+    bool used;
+    uint16_t *i;
+    RVertex *v;
+} Buf;
+
+static struct {
+    float m[9], mul[2], add[2];
+    uint32_t clr, bg;
+    int vx, vy, vw, vh;
+    int w, h, nx, ny; // Framebuffer size, and in tiles
+    uint32_t *px;
+    bool clear;
+    size_t nt, mt, nb;
+    Tri *t;
+    Bin *bin;
+    Buf *buf;
+} r;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t work, done;
+    size_t gen, busy, next, nw;
+    bool quit;
+    pthread_t *w;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, false, NULL};
+
+static void submit(size_t ni, const uint16_t *i, const RVertex *v);
+static void addTri(const float *x, const float *y);
+static void flush(void);
+static void *worker(void *arg);
+static void rasterTile(size_t k);
+static uint32_t pack(uint8_t r, uint8_t g, uint8_t b);
+
+// Draws into memory instead of through GLES 2.0. Triangles are transformed
+// as they come, binned into TS x TS tiles and rasterized once their pixels
+// are read back, every core taking tiles in turn.
+void rInit(void) {
+    memset(&r, 0, sizeof(r));
+    rPipe(1, 1, 0, 0);
+    rMat(NULL);
+    rColor((const uint8_t[]){255, 255, 255});
+
+    long nw = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.nw = nw < 1 ? 1 : nw;
+    pool.quit = false;
+    pool.w = malloc(pool.nw * sizeof(*pool.w));
+    for (size_t k = 0; k < pool.nw; ++k) {
+        pthread_create(pool.w + k, NULL, worker, NULL);
+    }
+}
+
+void rExit(void) {
+    pthread_mutex_lock(&pool.mu);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mu);
+    for (size_t k = 0; k < pool.nw; ++k) {
+        pthread_join(pool.w[k], NULL);
+    }
+    free(pool.w);
+
+    for (size_t k = 0; k < (size_t)r.nx * r.ny; ++k) {
+        free(r.bin[k].t);
+    }
+    free(r.bin);
+    free(r.buf);
+    free(r.t);
+    free(r.px);
+}
+
+void rPipe(float mulX, float mulY, float addX, float addY) {
+    r.mul[0] = mulX;
+    r.mul[1] = mulY;
+    r.add[0] = addX;
+    r.add[1] = addY;
+}
+
+void rMat(const float *m) {
+    const float I[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    memcpy(r.m, m ? m : I, sizeof(r.m));
+}
+
+void rColor(const uint8_t *rgb) {
+    r.clr = pack(rgb[0], rgb[1], rgb[2]);
+}
+
+void rTris(size_t ni, const uint16_t *i, const RVertex *v) {
+    submit(ni, i, v);
+}
+
+// Everything drawn before is covered, so it is dropped unrasterized.
+void rClear(uint8_t red, uint8_t green, uint8_t blue) {
+    for (size_t k = 0; k < (size_t)r.nx * r.ny; ++k) {
+        r.bin[k].n = 0;
+    }
+    r.nt = 0;
+    r.bg = pack(red, green, blue);
+    r.clear = true;
+}
+
+// The framebuffer grows to hold the viewport, keeping what it shows. A
+// clear still pending is kept for the new size; one flushed with triangles
+// binned to the old tiles is applied to the new area here.
+void rViewport(int x, int y, int w, int h) {
+    r.vx = x;
+    r.vy = y;
+    r.vw = w;
+    r.vh = h;
+    if (x + w <= r.w && y + h <= r.h) {
+        return;
+    }
+
+    bool clear = r.clear;
+    if (r.nt > 0) {
+        flush();
+    }
+    int fw = MAX(r.w, x + w), fh = MAX(r.h, y + h);
+    uint32_t *px = calloc((size_t)fw * fh, sizeof(*px));
+    for (size_t k = 0; clear && k < (size_t)fw * fh; ++k) {
+        px[k] = r.bg;
+    }
+    for (int j = 0; j < r.h; ++j) {
+        memcpy(px + (size_t)j * fw, r.px + (size_t)j * r.w, r.w * sizeof(*px));
+    }
+    free(r.px);
+    for (size_t k = 0; k < (size_t)r.nx * r.ny; ++k) {
+        free(r.bin[k].t);
+    }
+    r.px = px;
+    r.w = fw;
+    r.h = fh;
+    r.nx = (fw + TS - 1) / TS;
+    r.ny = (fh + TS - 1) / TS;
+    r.bin = realloc(r.bin, (size_t)r.nx * r.ny * sizeof(*r.bin));
+    memset(r.bin, 0, (size_t)r.nx * r.ny * sizeof(*r.bin));
+}
+
+// Reads back w x h pixels from (x, y), as RGBA rows bottom up, rasterizing
+// what is still binned first. Pixels outside the framebuffer read as 0.
+void rRead(int x, int y, int w, int h, uint8_t *rgba) {
+    flush();
+    memset(rgba, 0, (size_t)w * h * 4);
+    for (int j = MAX(0, -y); j < h && y + j < r.h; ++j) {
+        int i0 = MAX(0, -x), i1 = MIN(w, r.w - x);
+        if (i1 > i0) {
+            memcpy(rgba + ((size_t)j * w + i0) * 4, r.px + (size_t)(y + j) * r.w + x + i0, (i1 - i0) * 4);
+        }
+    }
+}
+
+// Buffers live in memory; vbo and ibo both name the slot of r.buf, from 1.
+RBuf rBufNew(int use) {
+    size_t k = 0;
+    while (k < r.nb && r.buf[k].used) {
+        ++k;
+    }
+    if (k == r.nb) {
+        r.buf = realloc(r.buf, ++r.nb * sizeof(*r.buf));
+    }
+    r.buf[k] = (Buf){true, NULL, NULL};
+    return (RBuf){k + 1, k + 1, 0, 0, use};
+}
+
+void rBufDel(RBuf *b) {
+    if (b->vbo > 0) {
+        Buf *f = r.buf + b->vbo - 1;
+        free(f->i);
+        free(f->v);
+        *f = (Buf){false, NULL, NULL};
+    }
+    b->vbo = b->ibo = 0;
+    b->mi = b->mv = 0;
+}
+
+// Uploads ni indices at index oi and nv vertices at vertex ov. Unlike on the
+// GPU, storage keeps what it held when it grows.
+void rBufData(RBuf*b,size_t oi,size_t ni,const uint16_t*i,size_t ov,size_t nv,const RVertex*v){
+    Buf *f = r.buf + b->vbo - 1;
+    if (b->mi < oi + ni) {
+        b->mi = b->mi * 2 < oi + ni ? oi + ni : b->mi * 2;
+        f->i = realloc(f->i, b->mi * sizeof(*i));
+    }
+    if (ni > 0) {
+        memcpy(f->i + oi, i, ni * sizeof(*i));
+    }
+    if (b->mv < ov + nv) {
+        b->mv = b->mv * 2 < ov + nv ? ov + nv : b->mv * 2;
+        f->v = realloc(f->v, b->mv * sizeof(*v));
+    }
+    if (nv > 0) {
+        memcpy(f->v + ov, v, nv * sizeof(*v));
+    }
+}
+
+// Draws the ni indices from index oi, which count vertices from vertex ov.
+void rBufTris(const RBuf *b, size_t ov, size_t oi, size_t ni) {
+    const Buf *f = r.buf + b->vbo - 1;
+    submit(ni, f->i + oi, f->v + ov);
+}
+
+// Takes the triangles to window coordinates as the vertex shader of r.c and
+// the viewport would, snapped to 1/SP pixel.
+static void submit(size_t ni, const uint16_t *i, const RVertex *v) {
+    const float *m = r.m;
+    for (size_t j = 0; j + 2 < ni; j += 3) {
+        float x[3], y[3];
+        for (size_t k = 0; k < 3; ++k) {
+            const RVertex *p = v + i[j + k];
+            float nx = (m[0] * p->x + m[3] * p->y + m[6]) * r.mul[0] + r.add[0];
+            float ny = (m[1] * p->x + m[4] * p->y + m[7]) * r.mul[1] + r.add[1];
+            x[k] = roundf((r.vx + (nx + 1) * r.vw / 2) * SP) / SP;
+            y[k] = roundf((r.vy + (ny + 1) * r.vh / 2) * SP) / SP;
+        }
+        addTri(x, y);
+    }
+}
+
+// Sets up the edges of a triangle, counter-clockwise, and bins it into every
+// tile its clipped bounds touch. Triangles with no area are dropped.
+static void addTri(const float *x, const float *y) {
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+    if (!(area > 0 || area < 0)) {
+        return;
+    }
+    int o[3] = {0, area > 0 ? 1 : 2, area > 0 ? 2 : 1};
+
+    float x0 = fmaxf(MIN(x[0], MIN(x[1], x[2])) - 0.5F, MAX(r.vx, 0));
+    float y0 = fmaxf(MIN(y[0], MIN(y[1], y[2])) - 0.5F, MAX(r.vy, 0));
+    float x1 = fminf(MAX(x[0], MAX(x[1], x[2])) - 0.5F, MIN(r.vx + r.vw, r.w) - 1);
+    float y1 = fminf(MAX(y[0], MAX(y[1], y[2])) - 0.5F, MIN(r.vy + r.vh, r.h) - 1);
+    if (!(x0 <= x1 && y0 <= y1)) {
+        return;
+    }
+
+    if (r.nt >= r.mt) {
+        r.mt = r.mt ? r.mt * 2 : 256;
+        r.t = realloc(r.t, r.mt * sizeof(*r.t));
+    }
+    Tri *t = r.t + r.nt;
+    for (int k = 0; k < 3; ++k) {
+        int a = o[k], b = o[(k + 1) % 3];
+        float dx = x[b] - x[a], dy = y[b] - y[a];
+        bool up = x[a] < x[b] || (x[a] == x[b] && y[a] < y[b]);
+        int l = up ? a : b;
+        t->ax[k] = x[l];
+        t->ay[k] = y[l];
+        t->dx[k] = up ? dx : -dx;
+        t->dy[k] = up ? dy : -dy;
+        t->s[k] = up ? 1 : -1;
+        t->own[k] = dy < 0 || (dy == 0 && dx > 0);
+    }
+    t->c = r.clr;
+    t->x0 = ceilf(x0);
+    t->y0 = ceilf(y0);
+    t->x1 = (int)floorf(x1) + 1;
+    t->y1 = (int)floorf(y1) + 1;
+
+    for (int ty = t->y0 / TS; ty <= (t->y1 - 1) / TS; ++ty) {
+        for (int tx = t->x0 / TS; tx <= (t->x1 - 1) / TS; ++tx) {
+            Bin *n = r.bin + (size_t)ty * r.nx + tx;
+            if (n->n >= n->m) {
+                n->m = n->m ? n->m * 2 : 64;
+                n->t = realloc(n->t, n->m * sizeof(*n->t));
+            }
+            n->t[n->n++] = r.nt;
+        }
+    }
+    ++r.nt;
+}
+
+// Rasterizes every tile on the pool and empties the bins.
+static void flush(void) {
+    if (r.nt == 0 && !r.clear) {
+        return;
+    }
+    pthread_mutex_lock(&pool.mu);
+    pool.next = 0;
+    pool.busy = pool.nw;
+    ++pool.gen;
+    pthread_cond_broadcast(&pool.work);
+    while (pool.busy > 0) {
+        pthread_cond_wait(&pool.done, &pool.mu);
+    }
+    pthread_mutex_unlock(&pool.mu);
+
+    for (size_t k = 0; k < (size_t)r.nx * r.ny; ++k) {
+        r.bin[k].n = 0;
+    }
+    r.nt = 0;
+    r.clear = false;
+}
+
+static void *worker(void *arg) {
+    size_t gen = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&pool.mu);
+    while (true) {
+        while (pool.gen == gen && !pool.quit) {
+            pthread_cond_wait(&pool.work, &pool.mu);
+        }
+        if (pool.quit) {
+            break;
+        }
+        gen = pool.gen;
+        while (pool.next < (size_t)r.nx * r.ny) {
+            size_t k = pool.next++;
+            pthread_mutex_unlock(&pool.mu);
+            rasterTile(k);
+            pthread_mutex_lock(&pool.mu);
+        }
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.mu);
+    return NULL;
+}
+
+// Triangles are drawn in the order they came, VW pixels of a row at once.
+static void rasterTile(size_t k) {
+    int tx0 = k % r.nx * TS, ty0 = k / r.nx * TS;
+    int tx1 = MIN(tx0 + TS, r.w), ty1 = MIN(ty0 + TS, r.h);
+    const Bin *n = r.bin + k;
+
+    if (r.clear) {
+        for (int y = ty0; y < ty1; ++y) {
+            for (int x = tx0; x < tx1; ++x) {
+                r.px[(size_t)y * r.w + x] = r.bg;
+            }
+        }
+    }
+    for (size_t j = 0; j < n->n; ++j) {
+        const Tri *t = r.t + n->t[j];
+        int x0 = MAX(t->x0, tx0), x1 = MIN(t->x1, tx1);
+        int y0 = MAX(t->y0, ty0), y1 = MIN(t->y1, ty1);
+        for (int y = y0; y < y1; ++y) {
+            uint32_t *row = r.px + (size_t)y * r.w;
+            V e[3];
+            for (int i = 0; i < 3; ++i) {
+                e[i] = V1(t->dx[i] * (y + 0.5F - t->ay[i]));
+            }
+            for (int x = x0; x < x1; x += VW) {
+                V c = VADD(V1(x + 0.5F), VSTEP);
+                V in = V1(0);
+                for (int i = 0; i < 3; ++i) {
+                    V w = VMUL(VSUB(e[i], VMUL(V1(t->dy[i]), VSUB(c, V1(t->ax[i])))), V1(t->s[i]));
+                    w = t->own[i] ? VLE(V1(0), w) : VLT(V1(0), w);
+                    in = i == 0 ? w : VAND(in, w);
+                }
+                int m = VMASK(in) & ((1 << MIN(VW, x1 - x)) - 1);
+                if (m == (1 << VW) - 1) {
+                    for (int i = 0; i < VW; ++i) {
+                        row[x + i] = t->c;
+                    }
+                } else {
+                    for (int i = 0; m; ++i, m >>= 1) {
+                        if (m & 1) {
+                            row[x + i] = t->c;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Packs a pixel as RGBA bytes in memory, the order rRead returns.
+static uint32_t pack(uint8_t r, uint8_t g, uint8_t b) {
+    uint32_t p;
+    memcpy(&p, (const uint8_t[]){r, g, b, 255}, 4);
+    return p;
+}
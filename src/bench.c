@@ -0,0 +1,305 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lib/lib.h"
+#include "wop.h"
+
+#define PI 3.1415926535
+
+#define MINT 0.05 // Minimum Time of one measured run, in seconds
+#define RUNS 5 // Runs per case, the fastest is reported
+#define NMIN 10 // Smallest size
+#define NMAX 100000 // Largest size
+#define STAIR "RRRRURRRRD" // Repeated to make wires that stay valid
+
+#define WC (const uint8_t[]){255, 255, 255} // Wire Color
+
+typedef struct {
+    const char *name;
+    void (*f)(size_t n);
+    bool each; // Whether each of the n primitives counts as an op
+} Case;
+
+static size_t allocs, bytes;
+static volatile float sink;
+static char *w0, *w1;
+static WOpCtx ctx;
+static Batch b;
+static float *vec;
+
+void *benchMalloc(size_t n);
+void *benchCalloc(size_t n, size_t s);
+void *benchRealloc(void *p, size_t n);
+int benchPosixMemalign(void **p, size_t a, size_t n);
+static char *stairWire(size_t n, char last);
+static double run(const Case *c, size_t n, size_t reps);
+static double now(void);
+static void wOpIsValidCase(size_t n);
+static void wOpGetRectCase(size_t n);
+static void wOpCtxGetRectCase(size_t n);
+static void wOpCurrWCase(size_t n);
+static void wOpNextWCase(size_t n);
+static void batchRectCase(size_t n);
+static void batchRectLineCase(size_t n);
+static void batchLineCase(size_t n);
+static void batchCircleCase(size_t n);
+static void batchPieSliceCase(size_t n);
+static void batchRingCase(size_t n);
+static void batchRingSliceCase(size_t n);
+static void batchAnyCase(size_t n);
+static void matMulVecCase(size_t n);
+
+static const Case cases[] = {
+    {"wOpIsValid", wOpIsValidCase, false},
+    {"wOpGetRect", wOpGetRectCase, false},
+    {"wOpCtxGetRect", wOpCtxGetRectCase, false},
+    {"wOpCurrW", wOpCurrWCase, false},
+    {"wOpNextW", wOpNextWCase, false},
+    {"batchRect", batchRectCase, true},
+    {"batchRectLine", batchRectLineCase, true},
+    {"batchLine", batchLineCase, true},
+    {"batchCircle", batchCircleCase, true},
+    {"batchPieSlice", batchPieSliceCase, true},
+    {"batchRing", batchRingCase, true},
+    {"batchRingSlice", batchRingSliceCase, true},
+    {"batchAny", batchAnyCase, true},
+    {"matMulVec", matMulVecCase, true},
+};
+
+// Every case runs at sizes NMIN to NMAX: wop cases on a wire of that many
+// segments, batch and mat cases on that many primitives or vectors. ns/op,
+// allocs/op and bytes/op are per call of the measured function; the same
+// lines are written tab separated to the file given as argument.
+int main(int argc, char *argv[]) {
+    FILE *f = argc > 1 ? fopen(argv[1], "w") : NULL;
+    if (argc > 1 && f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (f) {
+        fprintf(f, "case\tn\tns/op\tallocs/op\tbytes/op\n");
+    }
+    printf("%-16s %8s %14s %10s %12s\n", "case", "n", "ns/op", "allocs/op", "bytes/op");
+
+    b = batchNew(RSTREAM);
+    for (size_t n = NMIN; n <= NMAX; n *= 10) {
+        w0 = stairWire(n, '\0');
+        w1 = stairWire(n, 'R');
+        ctx = wOpCtxNew();
+        for (size_t i = 0; i < n; ++i) {
+            wOpCtxPush(&ctx, w0[i]);
+        }
+        vec = malloc(n * 3 * sizeof(*vec));
+        for (size_t i = 0; i < n * 3; ++i) {
+            vec[i] = i % 3 == 2 ? 1 : (float)(i % 7) - 3;
+        }
+        batchClear(&b);
+        for (size_t k = 0; k < sizeof(cases) / sizeof(*cases); ++k) {
+            size_t reps = 1;
+            while (run(cases + k, n, reps) < MINT) {
+                reps *= 2;
+            }
+
+            double best = 0;
+            size_t a = 0, by = 0;
+            for (size_t r = 0; r < RUNS; ++r) {
+                allocs = bytes = 0;
+                double dt = run(cases + k, n, reps);
+                best = r == 0 || dt < best ? dt : best;
+                a = allocs;
+                by = bytes;
+            }
+
+            double ops = (double)reps * (cases[k].each ? n : 1);
+            printf("%-16s %8zu %14.1f %10.3f %12.1f\n", cases[k].name, n, best / ops * 1e9, a / ops, by / ops);
+            if (f) {
+                fprintf(f, "%s\t%zu\t%.3f\t%.6f\t%.3f\n", cases[k].name, n, best / ops * 1e9, a / ops, by / ops);
+            }
+        }
+        free(vec);
+        wOpCtxDel(&ctx);
+        free(w1);
+        free(w0);
+    }
+    batchDel(&b);
+    if (f) {
+        fclose(f);
+    }
+}
+
+// wop.c and batch.c are built for the benchmark with malloc, calloc, realloc
+// and posix_memalign renamed to these counting wrappers.
+void *benchMalloc(size_t n) {
+    ++allocs;
+    bytes += n;
+    return malloc(n);
+}
+
+void *benchCalloc(size_t n, size_t s) {
+    ++allocs;
+    bytes += n * s;
+    return calloc(n, s);
+}
+
+void *benchRealloc(void *p, size_t n) {
+    ++allocs;
+    bytes += n;
+    return realloc(p, n);
+}
+
+int benchPosixMemalign(void **p, size_t a, size_t n) {
+    ++allocs;
+    bytes += n;
+    return posix_memalign(p, a, n);
+}
+
+// batch.c refers to the renderer only from batchDraw and batchDel, neither
+// of which touches the GPU here.
+RBuf rBufNew(int use) {
+    return (RBuf){0, 0, 0, 0, use};
+}
+
+void rBufDel(RBuf *b) {
+    (void)b;
+}
+
+void rBufData(RBuf*b,size_t oi,size_t ni,const uint16_t*i,size_t ov,size_t nv,const RVertex*v) {
+    (void)b; (void)oi; (void)ni; (void)i; (void)ov; (void)nv; (void)v;
+}
+
+void rBufTris(const RBuf *b, size_t ov, size_t oi, size_t ni) {
+    (void)b; (void)ov; (void)oi; (void)ni;
+}
+
+void rColor(const uint8_t *rgb) {
+    (void)rgb;
+}
+
+// n segments of a staircase, then last if it is not '\0'.
+static char *stairWire(size_t n, char last) {
+    char *w = malloc(n + 2);
+    for (size_t i = 0; i < n; ++i) {
+        w[i] = STAIR[i % (sizeof(STAIR) - 1)];
+    }
+    w[n] = last;
+    w[n + 1] = '\0';
+    return w;
+}
+
+static double run(const Case *c, size_t n, size_t reps) {
+    double t = now();
+    for (size_t i = 0; i < reps; ++i) {
+        c->f(n);
+    }
+    return now() - t;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void wOpIsValidCase(size_t n) {
+    (void)n;
+    sink += wOpIsValid(w0);
+}
+
+static void wOpGetRectCase(size_t n) {
+    (void)n;
+    sink += wOpGetRect(w0, w1, true, 'R', 0.5F).w;
+}
+
+static void wOpCtxGetRectCase(size_t n) {
+    (void)n;
+    sink += wOpCtxGetRect(&ctx, 'L', true, 'R', 0.5F).w;
+}
+
+static void wOpCurrWCase(size_t n) {
+    (void)n;
+    char *w = wOpCurrW(w0, 'U');
+    sink += w[0];
+    free(w);
+}
+
+static void wOpNextWCase(size_t n) {
+    (void)n;
+    char *w = wOpNextW(w0, 'U', 'R');
+    sink += w[0];
+    free(w);
+}
+
+static void batchRectCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchRect(&b, (float[]){i, 0, 1, 2}, WC);
+    }
+}
+
+static void batchRectLineCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchRectLine(&b, (float[]){i, 0, 1, 2}, 0.1F, 0.1F, WC);
+    }
+}
+
+static void batchLineCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchLine(&b, i, 0, i * 0.01F, 1, 0.1F, WC);
+    }
+}
+
+static void batchCircleCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchCircle(&b, i, 0, 0.5F, i * 0.01F, 40, WC);
+    }
+}
+
+static void batchPieSliceCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchPieSlice(&b, i, 0, 0.5F, i * 0.01F, PI / 2, 40, WC);
+    }
+}
+
+static void batchRingCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchRing(&b, i, 0, 0.5F, 0.05F, i * 0.01F, 40, WC);
+    }
+}
+
+static void batchRingSliceCase(size_t n) {
+    batchClear(&b);
+    for (size_t i = 0; i < n; ++i) {
+        batchRingSlice(&b, i, 0, 0.5F, 0.05F, i * 0.01F, PI / 2, 40, WC);
+    }
+}
+
+static void batchAnyCase(size_t n) {
+    static const uint16_t i[6] = {0, 1, 2, 2, 3, 0};
+    static const RVertex v[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    batchClear(&b);
+    batchColor(&b, WC);
+    for (size_t j = 0; j < n; ++j) {
+        batchAny(&b, 6, i, 4, v);
+    }
+}
+
+static void matMulVecCase(size_t n) {
+    float m[9], mv[3];
+    float s = 0;
+    matRot(m, 0.5F);
+    m[6] = 1;
+    m[7] = 2;
+    for (size_t i = 0; i < n; ++i) {
+        matMulVec(mv, m, vec + i * 3);
+        s += mv[0] + mv[1];
+    }
+    sink += s;
+}
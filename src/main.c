@@ -1,19 +1,26 @@
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <tgmath.h>
 
+#ifndef RSW
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 #include "../lib/lib.h"
 #include "wop.h"
 
 #define PI 3.1415926535
 
-#define QQ 40 // Quality of Quarter rings
-#define QC 40 // Quality of Circle
-#define QCS 8 // Quality of Circle Screw
+#define QQ 40 // Quality of Quarter rings, at most
+#define QC 40 // Quality of Circle, at most
+#define QCS 8 // Quality of Circle Screw, at most
+#define LE 0.5 // Largest Error of tessellated arcs, in pixels
+#define LH 1.25 // Lod Hysteresis, how far past a threshold s.ppu goes to switch
 
 #define WIN_T "Wire Bending Machine Simulator"
 #define OGL_API GLFW_OPENGL_ES_API
@@ -21,6 +28,9 @@
 #define VSYNC 1
 #define MSAA 16
 #define ZOOM 0.25
+#define REC_W 1280 // Recorded frame Width
+#define REC_H 720 // Recorded frame Height
+#define REC_FPS 30 // Recorded Frames Per Second, by default
 
 #define CCT (0.05) // Circle Contour Thickness
 #define CSR (0.05) // Circle Screw Radius
@@ -38,87 +48,260 @@
 
 float DT = 1.0F; // Standart Animation duration
 
+#define PO (const float[]){-1, -1, 0.8, 0.6} // Profiler Overlay rectangle
+
+enum {SCAMERA, SBALLS, SACTIVE, SPASSIVE, STRIS, SSWAP, SN}; // Profiled Stages
+
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define MAX(x,y) ((x)>(y)?(x):(y))
 #define CLAMP(min,val,max) (MIN((max),MAX((min),(val))))
 
 static struct S {
-    Batch b;
+    Batch b, ball;
+    WOpCtx ctx;
+    float ppu;
+    struct {
+        size_t qq, qc, qcs;
+        float ac[QQ], as[QQ]; // Cosine and sine of the qq angles of a quarter ring
+    } lod;
+    struct {
+        bool overlay, key;
+    } prof;
+    struct {
+        double t; // Simulation time of the current frame
+        double step; // Seconds each frame advances t by, 0 for real time
+        double real; // Real time of the last frame
+    } clock;
     struct {
         bool on;
         double start;
         char action;
     } animation;
     struct {
-        size_t n, m;
-        char active, *passive;
+        size_t n, m, k; // Actions queued, room for them, next one taken
+        char *a;
+        bool fast; // Whether they are committed without animating
+    } queue;
+    struct {
+        char active;
+        WOpWire passive;
+        Batch mesh;
     } wire;
 } s;
 
 static void initS(void);
 static void exitS(void);
+static void recLoop(int w, int h);
+static void tick(void);
+static void advanceClock(double dt);
+#ifndef RSW
 static void loop(GLFWwindow *win);
+static void onKey(GLFWwindow *win, int key, int scancode, int action, int mods);
+static char keyAction(GLFWwindow *win);
 static GLFWwindow *mkWin(const char *t, int api, int v, int vs, int aa);
+#endif
+static double now(void);
+static bool mkPbuf(int w, int h, int v, int aa);
+static void delPbuf(void);
 static void draw(int winW, int winH);
 static void setupCameraAndDrawDeadWire(int winW, int winH);
-static float setMinCamRect(WOpRect r, float ar);
+static float setMinCamRect(WOpRect r, int winW, int winH);
+static void updateLod(void);
+static size_t lod(float r, float a, size_t min, size_t max, size_t n);
+static size_t lodAt(float rp, float a, size_t min, size_t max);
 static void drawBalls(void);
 static void drawBall(float cx, float cy, float a);
+static void batchBall(Batch *b);
 static void drawActiveWire(void);
 static void drawPassiveWire(void);
 static void drawPassiveStaticWire(const float *matrix);
+static void quarterTab(void);
+static void batchPassiveWire(size_t k);
+static void batchPassiveEnd(size_t k, bool join);
+static void batchSection(Batch *b, float x, float y, float mx, float my, bool join);
+static void leftOf(char dir, float *x, float *y);
+static void pushPassiveWire(char w);
+static void popPassiveWire(void);
 static void stopAnimation(void);
-static void startAnimation(GLFWwindow *win);
+static void endAnimation(void);
+static void queueActions(const char *a);
+static void runQueue(void);
+static void act(char action);
+static void startAnimation(char action);
 static bool wireWillBeValid(char action);
 
 int main(int argc, char *argv[]) {
     //Check Arguments
+    const char *trace = NULL;
+    bool overlay = false;
+    double step = 0, fps = REC_FPS;
+    const char *record = NULL, *play = "";
+    bool fast = false;
     for (int i = 0; i < argc; i++) {
         if (argc > i+1 && strcmp(argv[i],"--anim-duration") == 0) {
             if (atof(argv[i+1]) != 0) {
                 DT = atof(argv[i+1]);
             }
         }
+        if (strcmp(argv[i], "--exhaustive") == 0) {
+            wOpBroadPhase = false;
+        }
+        if (argc > i+1 && strcmp(argv[i], "--trace") == 0) {
+            trace = argv[i+1];
+        }
+        if (strcmp(argv[i], "--prof") == 0) {
+            overlay = true;
+        }
+        if (argc > i+1 && strcmp(argv[i], "--step") == 0) {
+            step = MAX(0, atof(argv[i+1]));
+        }
+        if (argc > i+1 && strcmp(argv[i], "--record") == 0) {
+            record = argv[i+1];
+        }
+        if (argc > i+1 && strcmp(argv[i], "--play") == 0) {
+            play = argv[i+1];
+        }
+        if (argc > i+1 && strcmp(argv[i], "--fps") == 0 && atof(argv[i+1]) > 0) {
+            fps = atof(argv[i+1]);
+        }
+        if (strcmp(argv[i], "--fast") == 0) {
+            fast = true;
+        }
     }
 
-    glfwInit();
-    GLFWwindow *win = mkWin(WIN_T, OGL_API, OGL_V, VSYNC, MSAA);
-    glfwSetInputMode(win, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
+#ifndef RSW
+    GLFWwindow *win = NULL;
+#endif
+    if (record) {
+        if (!mkPbuf(REC_W, REC_H, OGL_V, MSAA)) {
+            fprintf(stderr, "%s: no offscreen EGL surface\n", argv[0]);
+            return 1;
+        }
+        step = 1 / fps;
+    } else {
+#ifdef RSW
+        fprintf(stderr, "%s: the software renderer can only --record\n", argv[0]);
+        return 1;
+#else
+        glfwInit();
+        win = mkWin(WIN_T, OGL_API, OGL_V, VSYNC, MSAA);
+        glfwSetInputMode(win, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
+        glfwSetKeyCallback(win, onKey);
+#endif
+    }
     rInit();
     initS();
+    s.prof.overlay = overlay;
+    s.clock.step = step;
+    s.clock.real = record ? 0 : now();
+    s.queue.fast = fast;
+    queueActions(play);
+    profInit(SN, (const char *const[]){"camera", "balls", "active", "passive", "tris", "swap"}, trace);
+
+    if (record) {
+        recInit(record, REC_W, REC_H);
+        recLoop(REC_W, REC_H);
+        recExit();
+    } else {
+#ifndef RSW
+        loop(win);
+#endif
+    }
 
-    loop(win);
-
+    profExit();
     exitS();
     rExit();
-    glfwTerminate();
+    if (record) {
+        delPbuf();
+    } else {
+#ifndef RSW
+        glfwTerminate();
+#endif
+    }
 }
 
 static void initS(void) {
     memset(&s, 0, sizeof(s));
-    s.wire.m = 64;
     s.wire.active = 'L';
-    s.wire.passive = calloc(s.wire.m, 1);
+    s.wire.passive = wOpWireNew();
+    s.b = batchNew(RSTREAM);
+    s.ball = batchNew(RSTATIC);
+    s.lod.qq = QQ;
+    s.lod.qc = QC;
+    s.lod.qcs = QCS;
+    quarterTab();
+    batchBall(&s.ball);
+    s.wire.mesh = batchNew(RDYNAMIC);
+    s.ctx = wOpCtxNew();
 }
 
 static void exitS(void) {
-    free(s.wire.passive);
+    free(s.queue.a);
+    wOpWireDel(&s.wire.passive);
+    wOpCtxDel(&s.ctx);
+    batchDel(&s.wire.mesh);
+    batchDel(&s.ball);
     batchDel(&s.b);
 }
 
+// Renders each frame offscreen and records it, s.clock.step apart, until
+// the queued actions have all run and the machine rests.
+static void recLoop(int w, int h) {
+    for (bool last = false; !last;) {
+        last = !s.animation.on && s.queue.k == s.queue.n;
+        tick();
+
+        rClear(0, 0, 0);
+        draw(w, h);
+        PROF(SSWAP) recFrame();
+        profFrame();
+
+        stopAnimation();
+        runQueue();
+    }
+}
+
+// Samples the real time once per frame and advances the simulation clock by
+// what has passed since the last frame, or by exactly s.clock.step if set.
+static void tick(void) {
+    if (s.clock.step > 0) {
+        advanceClock(s.clock.step);
+        return;
+    }
+    double t = now();
+    advanceClock(t - s.clock.real);
+    s.clock.real = t;
+}
+
+// Everything the simulation animates reads s.clock.t, which moves only here,
+// so a frame renders from one time and a replay can run as fast as it draws.
+static void advanceClock(double dt) {
+    s.clock.t += dt;
+}
+
+#ifndef RSW
 static void loop(GLFWwindow *win) {
     while (!glfwWindowShouldClose(win)) {
         glfwPollEvents();
+        tick();
 
         int winW, winH;
         glfwGetFramebufferSize(win, &winW, &winH);
 
         rClear(0, 0, 0);
         draw(winW, winH);
-        glfwSwapBuffers(win);
+        PROF(SSWAP) glfwSwapBuffers(win);
+        profFrame();
 
         stopAnimation();
-        startAnimation(win);
+        runQueue();
+        if (!s.queue.fast) {
+            startAnimation(keyAction(win));
+        }
+
+        bool key = glfwGetKey(win, GLFW_KEY_F3);
+        s.prof.overlay ^= key && !s.prof.key;
+        s.prof.key = key;
 
         if (glfwGetKey(win, GLFW_KEY_ESCAPE) || glfwGetKey(win, GLFW_KEY_Q)) {
             glfwSetWindowShouldClose(win, true);
@@ -126,6 +309,26 @@ static void loop(GLFWwindow *win) {
     }
 }
 
+// Actions keyed during an animation are queued, not lost; F toggles fast
+// forward. Keys held once the machine is idle are read by keyAction.
+static void onKey(GLFWwindow *win, int key, int scancode, int action, int mods) {
+    (void)win; (void)scancode; (void)mods;
+    if (action != GLFW_PRESS) {
+        return;
+    }
+    queueActions(key == GLFW_KEY_LEFT ? "L" : key == GLFW_KEY_RIGHT ? "R"
+               : key == GLFW_KEY_UP ? "U" : key == GLFW_KEY_DOWN ? "D" : "");
+    s.queue.fast ^= key == GLFW_KEY_F;
+}
+
+static char keyAction(GLFWwindow *win) {
+    int left = glfwGetKey(win, GLFW_KEY_LEFT);
+    int right = glfwGetKey(win, GLFW_KEY_RIGHT);
+    int up = glfwGetKey(win, GLFW_KEY_UP);
+    int down = glfwGetKey(win, GLFW_KEY_DOWN);
+    return left ? 'L' : right ? 'R' : up ? 'U' : down ? 'D' : '\0';
+}
+
 static GLFWwindow *mkWin(const char *t, int api, int v, int vs, int aa) {
     glfwWindowHint(GLFW_CLIENT_API, api);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, v / 10);
@@ -146,22 +349,82 @@ static GLFWwindow *mkWin(const char *t, int api, int v, int vs, int aa) {
     return win;
 }
 
+static double now(void) {
+    return glfwGetTime();
+}
+
+static EGLDisplay pbuf = EGL_NO_DISPLAY;
+
+// Makes current an offscreen w x h surface for OpenGL ES version v, with
+// up to aa samples. Mesa's surfaceless platform needs no window system.
+static bool mkPbuf(int w, int h, int v, int aa) {
+    EGLDisplay d = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    d = d != EGL_NO_DISPLAY ? d : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (d == EGL_NO_DISPLAY || !eglInitialize(d, NULL, NULL)) {
+        return false;
+    }
+
+    EGLConfig c;
+    EGLint n = 0;
+    for (int k = aa; n == 0 && k >= 0; k = k > 1 ? k / 2 : k - 1) {
+        const EGLint ca[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+            EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_SAMPLES, k, EGL_NONE,
+        };
+        eglChooseConfig(d, ca, &c, 1, &n);
+    }
+    eglBindAPI(EGL_OPENGL_ES_API);
+    EGLSurface p = n ? eglCreatePbufferSurface(d, c, (const EGLint[]){EGL_WIDTH, w, EGL_HEIGHT, h, EGL_NONE}) : EGL_NO_SURFACE;
+    EGLContext x = n ? eglCreateContext(d, c, EGL_NO_CONTEXT, (const EGLint[]){EGL_CONTEXT_CLIENT_VERSION, v / 10, EGL_NONE}) : EGL_NO_CONTEXT;
+    if (p == EGL_NO_SURFACE || x == EGL_NO_CONTEXT || !eglMakeCurrent(d, p, p, x)) {
+        eglTerminate(d);
+        return false;
+    }
+    pbuf = d;
+    return true;
+}
+
+static void delPbuf(void) {
+    eglTerminate(pbuf);
+}
+#else
+// The software renderer only records, which always steps the clock.
+static double now(void) {
+    return 0;
+}
+
+// lib/sw.c draws into memory and needs no surface.
+static bool mkPbuf(int w, int h, int v, int aa) {
+    (void)w; (void)h; (void)v; (void)aa;
+    return true;
+}
+
+static void delPbuf(void) {
+}
+#endif
+
 static void draw(int winW, int winH) {
-    setupCameraAndDrawDeadWire(winW, winH);
-    drawBalls();
-    drawActiveWire();
-    drawPassiveWire();
-    rTris(s.b.ni, s.b.i, s.b.v);
+    PROF(SCAMERA) setupCameraAndDrawDeadWire(winW, winH);
+    updateLod();
+    PROF(STRIS) batchDraw(&s.b);
     batchClear(&s.b);
+    PROF(SBALLS) drawBalls();
+    PROF(SACTIVE) drawActiveWire();
+    PROF(STRIS) batchDraw(&s.b);
+    batchClear(&s.b);
+    PROF(SPASSIVE) drawPassiveWire();
+
+    if (s.prof.overlay) {
+        rPipe(1, 1, 0, 0);
+        profBatch(&s.b, PO);
+        batchDraw(&s.b);
+        batchClear(&s.b);
+    }
 }
 
 static void setupCameraAndDrawDeadWire(int winW, int winH) {
-    float dt = s.animation.on ? CLAMP(0, (glfwGetTime() - s.animation.start) / DT, 1) : 0;
-    char *w0 = wOpCurrW(s.wire.passive, s.wire.active);
-    char *w1 = wOpNextW(s.wire.passive, s.wire.active, s.animation.action);
-    WOpRect r = wOpGetRect(w0, w1, s.animation.on, s.animation.action, dt);
-    free(w1);
-    free(w0);
+    float dt = s.animation.on ? CLAMP(0, (s.clock.t - s.animation.start) / DT, 1) : 0;
+    WOpRect r = wOpCtxGetRect(&s.ctx, s.wire.active, s.animation.on, s.animation.action, dt);
 
     r.x *= 1;
     r.y *= 1;
@@ -179,30 +442,79 @@ static void setupCameraAndDrawDeadWire(int winW, int winH) {
     r.h = MAX(CMINH(r.y), r.h);
 
     rViewport(0, 0, winW, winH);
-    float swl = setMinCamRect(r, (float)winW / (float)winH);
+    float swl = setMinCamRect(r, winW, winH);
     batchRect(&s.b, (const float[]){-swl, -0.5, swl, 1}, WC);
 }
 
-static float setMinCamRect(WOpRect r, float ar) {
+// Also sets s.ppu, the pixels per unit of the zoom it picks.
+static float setMinCamRect(WOpRect r, int winW, int winH) {
+    float ar = (float)winW / (float)winH;
     float zx = (2 * ar) / (r.w + 0.001);
     float zy = 2.0 / (r.h + 0.001);
     if (zx < zy) {
         float cy = r.y + r.h / 2;
         rPipe(zx / ar, zx, -1 - r.x * (zx / ar), -cy * zx);
+        s.ppu = zx * winH / 2;
         return r.x < 0 ? -r.x : r.x;
     } else {
         float cx = r.x + r.w / 2;
         rPipe(zy / ar, zy, -cx * (zx / ar), -1 - r.y * zy);
+        s.ppu = zy * winH / 2;
         return (2 * ar) / zy;
     }
 }
 
+// Picks the tessellation of arcs for the zoom of this frame, rebuilding the
+// meshes made at another one.
+static void updateLod(void) {
+    size_t qq = lod(1.5, PI / 2, 1, QQ - 1, s.lod.qq - 1) + 1;
+    size_t qc = lod(0.5, PI * 2, 4, QC, s.lod.qc);
+    size_t qcs = lod(CSR, PI * 2, 4, QCS, s.lod.qcs);
+
+    if (qc != s.lod.qc || qcs != s.lod.qcs) {
+        s.lod.qc = qc;
+        s.lod.qcs = qcs;
+        batchClear(&s.ball);
+        batchBall(&s.ball);
+    }
+    if (qq != s.lod.qq) {
+        s.lod.qq = qq;
+        quarterTab();
+        batchClear(&s.wire.mesh);
+        for (size_t k = 0; k < s.wire.passive.n; ++k) {
+            batchPassiveWire(k);
+        }
+    }
+}
+
+// Segments for an arc of radius r and angle a, now n, at s.ppu pixels per
+// unit. n only goes up once s.ppu is LH times past the threshold that wants
+// more, and down once it is LH times below the one that wants fewer, so a
+// zoom resting on a threshold does not rebuild meshes every frame.
+static size_t lod(float r, float a, size_t min, size_t max, size_t n) {
+    size_t lo = lodAt(r * s.ppu / LH, a, min, max);
+    size_t hi = lodAt(r * s.ppu * LH, a, min, max);
+    return n < lo || n > hi ? lodAt(r * s.ppu, a, min, max) : n;
+}
+
+// Segments for an arc of angle a and radius rp, in pixels, to stay within
+// LE pixels of the circle. Counts are powers of two from min, so a zoom
+// rebuilds meshes only once it halves or doubles them, up to max.
+static size_t lodAt(float rp, float a, size_t min, size_t max) {
+    float da = rp > LE ? 2 * acos(1 - LE / rp) : a;
+    size_t n = min;
+    while (n * da < a && n < max) {
+        n *= 2;
+    }
+    return MIN(n, max);
+}
+
 static void drawBalls(void) {
     if (!s.animation.on) {
         drawBall(0,  1, 0);
         drawBall(0, -1, 0);
     } else {
-        float dt = s.animation.on ? CLAMP(0, (glfwGetTime() - s.animation.start) / DT, 1) : 0;
+        float dt = s.animation.on ? CLAMP(0, (s.clock.t - s.animation.start) / DT, 1) : 0;
         float dt2 = 1 - fabs(1 - dt * 2); // While dt goes [0 -> 1], dt2 goes [0 -> 1 -> 0]
         if (s.animation.action == 'U') {
             drawBall(0, 1, 0);
@@ -232,14 +544,26 @@ static void drawBalls(void) {
     }
 }
 
+// Both balls share the mesh of s.ball, placed and turned by the matrix
+// uniform.
 static void drawBall(float cx, float cy, float a) {
+    float m0[9], m1[9], m2[9];
+    matRot(m0, a);
+    matTrans(m1, cx, cy);
+    matMul(m2, m1, m0);
+    rMat(m2);
+    PROF(STRIS) batchDraw(&s.ball);
+    rMat(NULL);
+}
+
+static void batchBall(Batch *b) {
     float da = PI * 2 / CSN;
-    batchCircle(&s.b, cx, cy, 0.5, a, QC, CC);
-    batchRing(&s.b, cx, cy, 0.5 - CCT / 2, CCT, a, QC, CCC);
+    batchCircle(b, 0, 0, 0.5, 0, s.lod.qc, CC);
+    batchRing(b, 0, 0, 0.5 - CCT / 2, CCT, 0, s.lod.qc, CCC);
     for (size_t i = 0; i < CSN; ++i) {
-        float x = cos(da * i + a) * CSO + cx;
-        float y = sin(da * i + a) * CSO + cy;
-        batchCircle(&s.b, x, y, CSR, a, QCS, CSC);
+        float x = cos(da * i) * CSO;
+        float y = sin(da * i) * CSO;
+        batchCircle(b, x, y, CSR, 0, s.lod.qcs, CSC);
     }
 }
 
@@ -248,43 +572,43 @@ static void drawActiveWire(void) {
         if (s.wire.active == 'R') {
             batchRect(&s.b, (const float[]){0, -0.5, PI / 2, 1}, WC);
         } else if (s.wire.active == 'U') {
-            batchRingSlice(&s.b, 0, 1, 1, 1, -PI/2,  PI/2, QQ, WC);
+            batchRingSlice(&s.b, 0, 1, 1, 1, -PI/2,  PI/2, s.lod.qq, WC);
         } else if (s.wire.active == 'D') {
-            batchRingSlice(&s.b, 0, -1, 1, 1,  PI/2, -PI/2, QQ, WC);
+            batchRingSlice(&s.b, 0, -1, 1, 1,  PI/2, -PI/2, s.lod.qq, WC);
         }
     } else {
-        float dt = s.animation.on ? CLAMP(0, (glfwGetTime() - s.animation.start) / DT, 1) : 0;
+        float dt = s.animation.on ? CLAMP(0, (s.clock.t - s.animation.start) / DT, 1) : 0;
         float dt2 = MIN(dt * 2, 1);
         float dt3 = dt2 * PI / 2;
         if (s.animation.action == 'L') {
             if (s.wire.active == 'R') {
                 batchRect(&s.b, (const float[]){0, -0.5, (1 - dt) * PI / 2, 1}, WC);
             } else if (s.wire.active == 'U') {
-                batchRingSlice(&s.b, 0, 1, 1, 1, -PI / 2, (1 - dt) *  PI / 2, QQ, WC);
+                batchRingSlice(&s.b, 0, 1, 1, 1, -PI / 2, (1 - dt) *  PI / 2, s.lod.qq, WC);
             } else if (s.wire.active == 'D') {
-                batchRingSlice(&s.b, 0, -1, 1, 1,  PI / 2, (1 - dt) * -PI / 2, QQ, WC);
+                batchRingSlice(&s.b, 0, -1, 1, 1,  PI / 2, (1 - dt) * -PI / 2, s.lod.qq, WC);
             }
         } else if (s.animation.action == 'U') {
             float a = -PI / 2 + dt3;
             if (s.wire.active == 'R') {
-                batchRingSlice(&s.b, 0, 1, 1, 1, -PI / 2, dt3, QQ, WC);
+                batchRingSlice(&s.b, 0, 1, 1, 1, -PI / 2, dt3, s.lod.qq, WC);
                 batchLine(&s.b, cos(a), sin(a) + 1, dt3, (PI / 2 - dt3), 1, WC);
             } else if (s.wire.active == 'U') {
-                batchRingSlice(&s.b, 0, 1, 1, 1, -PI/2,  PI/2, QQ, WC);
+                batchRingSlice(&s.b, 0, 1, 1, 1, -PI/2,  PI/2, s.lod.qq, WC);
             } else if (s.wire.active == 'D') {
-                batchRingSlice(&s.b, cos(a) * 2, sin(a) * 2 + 1, 1, 1, PI / 2 + dt3, -PI / 2 + dt3, QQ, WC);
-                batchRingSlice(&s.b, 0, 1, 1, 1, -PI / 2, dt3, QQ, WC);
+                batchRingSlice(&s.b, cos(a) * 2, sin(a) * 2 + 1, 1, 1, PI / 2 + dt3, -PI / 2 + dt3, s.lod.qq, WC);
+                batchRingSlice(&s.b, 0, 1, 1, 1, -PI / 2, dt3, s.lod.qq, WC);
             }
         } else if (s.animation.action == 'D') {
             float a = PI / 2 - dt3;
             if (s.wire.active == 'R') {
-                batchRingSlice(&s.b, 0, -1, 1, 1, PI / 2, -dt3, QQ, WC);
+                batchRingSlice(&s.b, 0, -1, 1, 1, PI / 2, -dt3, s.lod.qq, WC);
                 batchLine(&s.b, cos(a), sin(a) - 1, -dt3, (PI / 2 - dt3), 1, WC);
             } else if (s.wire.active == 'U') {
-                batchRingSlice(&s.b, cos(a) * 2, sin(a) * 2 - 1, 1, 1, -PI / 2 - dt3, PI / 2 - dt3, QQ, WC);
-                batchRingSlice(&s.b, 0, -1, 1, 1, PI / 2, -dt3, QQ, WC);
+                batchRingSlice(&s.b, cos(a) * 2, sin(a) * 2 - 1, 1, 1, -PI / 2 - dt3, PI / 2 - dt3, s.lod.qq, WC);
+                batchRingSlice(&s.b, 0, -1, 1, 1, PI / 2, -dt3, s.lod.qq, WC);
             } else if (s.wire.active == 'D') {
-                batchRingSlice(&s.b, 0, -1, 1, 1,  PI/2, -PI/2, QQ, WC);
+                batchRingSlice(&s.b, 0, -1, 1, 1,  PI/2, -PI/2, s.lod.qq, WC);
             }
         } else {
             batchRect(&s.b, (const float[]){0, -0.5, dt * PI / 2, 1}, WC);
@@ -297,7 +621,7 @@ static void drawPassiveWire(void) {
         drawPassiveStaticWire(NULL);
     } else {
         float m0[9], m1[9], m2[9];
-        float dt = CLAMP(0, (glfwGetTime() - s.animation.start) / DT, 1);
+        float dt = CLAMP(0, (s.clock.t - s.animation.start) / DT, 1);
         float dt2 = MIN(dt * 2, 1);
         if (s.animation.action == 'U') {
             if (s.wire.active == 'U') {
@@ -370,7 +694,6 @@ static void drawPassiveWire(void) {
 }
 
 static void drawPassiveStaticWire(const float *matrix) {
-    size_t oldnv = s.b.nv;
     char dir = s.wire.active;
     float x, y;
     if (s.wire.active == 'U') {
@@ -385,89 +708,142 @@ static void drawPassiveStaticWire(const float *matrix) {
         x = PI / 2;
         y = 0;
     }
-    for (size_t i = s.wire.n - 1; i < s.wire.n; --i) {
-        if (dir == 'U') {
-            if (s.wire.passive[i] == 'U') {
-                batchRingSlice(&s.b, x - 1, y, 1, 1, 0, PI / 2, QQ, WC);
-                x -= 1;
-                y += 1;
-                dir = 'L';
-            } else if (s.wire.passive[i] == 'D') {
-                batchRingSlice(&s.b, x + 1, y, 1, 1, PI, -PI / 2, QQ, WC);
-                x += 1;
-                y += 1;
-                dir = 'R';
-            } else {
-                batchLine(&s.b, x, y, PI / 2, PI / 2, 1, WC);
-                y += PI / 2;
-            }
-        } else if (dir == 'D') {
-            if (s.wire.passive[i] == 'U') {
-                batchRingSlice(&s.b, x + 1, y, 1, 1, PI, PI / 2, QQ, WC);
-                x += 1;
-                y -= 1;
-                dir = 'R';
-            } else if (s.wire.passive[i] == 'D') {
-                batchRingSlice(&s.b, x - 1, y, 1, 1, 0, -PI / 2, QQ, WC);
-                x -= 1;
-                y -= 1;
-                dir = 'L';
-            } else {
-                batchLine(&s.b, x, y, -PI / 2, PI / 2, 1, WC);
-                y -= PI / 2;
-            }
-        } else if (dir == 'L') {
-            if (s.wire.passive[i] == 'U') {
-                batchRingSlice(&s.b, x, y - 1, 1, 1, PI / 2, PI / 2, QQ, WC);
-                x -= 1;
-                y -= 1;
-                dir = 'D';
-            } else if (s.wire.passive[i] == 'D') {
-                batchRingSlice(&s.b, x, y + 1, 1, 1, -PI / 2, -PI / 2, QQ, WC);
-                x -= 1;
-                y += 1;
-                dir = 'U';
-            } else {
-                batchLine(&s.b, x, y, 0, -PI / 2, 1, WC);
-                x -= PI / 2;
-            }
-        } else {
-            if (s.wire.passive[i] == 'U') {
-                batchRingSlice(&s.b, x, y + 1, 1, 1, -PI / 2, PI / 2, QQ, WC);
-                x += 1;
-                y += 1;
-                dir = 'U';
-            } else if (s.wire.passive[i] == 'D') {
-                batchRingSlice(&s.b, x, y - 1, 1, 1, PI / 2, -PI / 2, QQ, WC);
-                x += 1;
-                y -= 1;
-                dir = 'D';
-            } else {
-                batchLine(&s.b, x, y, 0, PI / 2, 1, WC);
-                x += PI / 2;
-            }
-        }
+
+    double mx = 0;
+    double my = 0;
+    char mdir = 'R';
+    if (s.wire.passive.n > 0) {
+        wOpWirePose(&s.wire.passive, s.wire.passive.n - 1, &mx, &my, &mdir);
     }
 
+    float m0[9], m1[9], m2[9];
+    int q = strchr("RULD", dir) - strchr("RULD", mdir);
+    matTrans(m0, -mx, -my);
+    matRot(m1, q * PI / 2);
+    matMul(m2, m1, m0);
+    matTrans(m1, x, y);
+    matMul(m0, m1, m2);
     if (matrix) {
-        for (size_t i = oldnv; i < s.b.nv; ++i) {
-            float mv[3];
-            float v[3] = {s.b.v[i].x, s.b.v[i].y, 1};
-            matMulVec(mv, matrix, v);
-            s.b.v[i].x = mv[0];
-            s.b.v[i].y = mv[1];
+        matMul(m2, matrix, m0);
+        memcpy(m0, m2, sizeof(m0));
+    }
+
+    rMat(m0);
+    PROF(STRIS) batchDraw(&s.wire.mesh);
+    rMat(NULL);
+}
+
+static void quarterTab(void) {
+    for (size_t j = 0; j < s.lod.qq; ++j) {
+        s.lod.ac[j] = cos(PI / 2 * j / (s.lod.qq - 1));
+        s.lod.as[j] = sin(PI / 2 * j / (s.lod.qq - 1));
+    }
+}
+
+// s.wire.mesh holds the passive wire as one strip of sections across it, from
+// the free end to the machine end, in the frame of the free end: the one
+// s.wire.passive keeps its poses in, which does not move when parts come and
+// go at the machine end. A straight after a straight only moves the last
+// section; a bend adds the s.lod.qq - 1 sections of its quarter ring.
+static void batchPassiveWire(size_t k) {
+    char w = wOpWireAt(&s.wire.passive, k);
+    char p = k > 0 ? wOpWireAt(&s.wire.passive, k - 1) : '\0';
+    if (k == 0) {
+        batchSection(&s.wire.mesh, 0, 0, 0, 1, false);
+    }
+
+    if (w == 'R') {
+        if (p == 'R') {
+            batchClearAny(&s.wire.mesh, 0, 2);
         }
+        batchPassiveEnd(k, p != 'R');
+        return;
+    }
+
+    double x, y;
+    char dir;
+    float lx, ly;
+    wOpWirePose(&s.wire.passive, k, &x, &y, &dir);
+    leftOf(dir, &lx, &ly);
+    float t = w == 'U' ? 1 : -1;
+    float cx = x + lx * t;
+    float cy = y + ly * t;
+    for (size_t j = s.lod.qq - 2; j > 0; --j) {
+        float mx = s.lod.ac[j] * lx - t * s.lod.as[j] * ly;
+        float my = t * s.lod.as[j] * lx + s.lod.ac[j] * ly;
+        batchSection(&s.wire.mesh, cx - t * mx, cy - t * my, mx, my, true);
+    }
+    batchPassiveEnd(k, true);
+}
+
+// The section where part k meets the part after it, or the machine.
+static void batchPassiveEnd(size_t k, bool join) {
+    double x, y;
+    char dir;
+    float lx, ly;
+    wOpWirePose(&s.wire.passive, k, &x, &y, &dir);
+    leftOf(dir, &lx, &ly);
+    batchSection(&s.wire.mesh, x, y, lx, ly, join);
+}
+
+// Adds the two vertices of the wire across (x, y) along the unit vector
+// (mx, my), joined to the two added before them if join is set.
+static void batchSection(Batch *b, float x, float y, float mx, float my, bool join) {
+    uint16_t *i;
+    RVertex *v;
+    batchColor(b, WC);
+    uint16_t f = batchEmplace(b, join ? 6 : 0, 2, &i, &v);
+    v[0] = (RVertex){x + mx / 2, y + my / 2};
+    v[1] = (RVertex){x - mx / 2, y - my / 2};
+    if (join) {
+        i[0] = f - 2;
+        i[1] = f - 1;
+        i[2] = f + 1;
+        i[3] = f + 1;
+        i[4] = f + 0;
+        i[5] = f - 2;
+    }
+}
+
+static void leftOf(char dir, float *x, float *y) {
+    *x = dir == 'U' ? -1 : dir == 'D' ? 1 : 0;
+    *y = dir == 'R' ? 1 : dir == 'L' ? -1 : 0;
+}
+
+static void pushPassiveWire(char w) {
+    wOpWirePush(&s.wire.passive, w);
+    batchPassiveWire(s.wire.passive.n - 1);
+}
+
+static void popPassiveWire(void) {
+    size_t k = s.wire.passive.n - 1;
+    char p = k > 0 ? wOpWireAt(&s.wire.passive, k - 1) : '\0';
+    char w = wOpWirePop(&s.wire.passive);
+    if (w == 'R' && p == 'R') {
+        batchClearAny(&s.wire.mesh, 0, 2);
+        batchPassiveEnd(k - 1, false);
+    } else {
+        size_t n = w == 'R' ? 1 : s.lod.qq - 1;
+        batchClearAny(&s.wire.mesh, n * 6, n * 2 + (k == 0 ? 2 : 0));
     }
 }
 
 static void stopAnimation(void) {
-    if (!s.animation.on || s.animation.start + DT >= glfwGetTime()) {
-        return;
+    if (s.animation.on && s.animation.start + DT < s.clock.t) {
+        endAnimation();
     }
+}
+
+// Leaves the machine in the state the animation ends in.
+static void endAnimation(void) {
     s.animation.on = false;
     if (s.animation.action == 'L') {
-        s.wire.active = s.wire.n > 0 ? s.wire.passive[--s.wire.n] : 'L';
-        s.wire.passive[s.wire.n] = '\0';
+        size_t n = s.wire.passive.n;
+        s.wire.active = n > 0 ? wOpWireAt(&s.wire.passive, n - 1) : 'L';
+        wOpCtxPop(&s.ctx);
+        if (s.wire.active != 'L') {
+            popPassiveWire();
+        }
     } else if (s.animation.action == 'R') {
         s.wire.active = 'R';
     } else if (s.animation.action == 'U' && s.wire.active != 'L') {
@@ -477,37 +853,71 @@ static void stopAnimation(void) {
     }
 }
 
-static void startAnimation(GLFWwindow *win) {
-    int left = glfwGetKey(win, GLFW_KEY_LEFT);
-    int right = glfwGetKey(win, GLFW_KEY_RIGHT);
-    int up = glfwGetKey(win, GLFW_KEY_UP);
-    int down = glfwGetKey(win, GLFW_KEY_DOWN);
-    char action = left ? 'L' : right ? 'R' : up ? 'U' : down ? 'D' : '\0';
+// Appends the actions of a, skipping anything but "LRUD".
+static void queueActions(const char *a) {
+    for (; *a != '\0'; ++a) {
+        if (!strchr("LRUD", *a)) {
+            continue;
+        }
+        if (s.queue.n >= s.queue.m) {
+            s.queue.m = s.queue.m ? s.queue.m * 2 : 64;
+            s.queue.a = realloc(s.queue.a, s.queue.m);
+        }
+        s.queue.a[s.queue.n++] = *a;
+    }
+}
 
-    if (s.animation.on || !action || (left && s.wire.active == 'L') || !wireWillBeValid(action)) {
-        return;
+// Takes queued actions in order once the machine is idle, skipping those it
+// cannot take. Fast forward commits every one of them before the next frame,
+// which draws only where they end.
+static void runQueue(void) {
+    while (!s.animation.on && s.queue.k < s.queue.n) {
+        act(s.queue.a[s.queue.k++]);
     }
+    if (s.queue.k == s.queue.n) {
+        s.queue.k = s.queue.n = 0;
+    }
+}
 
-    s.animation.on = true;
-    s.animation.start = glfwGetTime();
+// Starts action, or with fast forward on commits it at once.
+static void act(char action) {
+    startAnimation(action);
+    if (s.queue.fast && s.animation.on) {
+        endAnimation();
+    }
+}
 
-    if (s.wire.n >= s.wire.m) {
-        s.wire.m = s.wire.m * 2;
-        s.wire.passive = realloc(s.wire.passive, s.wire.m + 1);
+// Starts action, one of "LRUD", unless the machine is busy or the action
+// would leave it in an invalid state. '\0' starts nothing.
+static void startAnimation(char action) {
+    if (s.animation.on || !action || (action == 'L' && s.wire.active == 'L') || !wireWillBeValid(action)) {
+        return;
     }
 
+    s.animation.on = true;
+    s.animation.start = s.clock.t;
+
     s.animation.action = action;
 
-    if (right && s.wire.active != 'L') {
-        s.wire.passive[s.wire.n++] = s.wire.active;
-        s.wire.passive[s.wire.n] = '\0';
+    if (action == 'R' && s.wire.active != 'L') {
+        wOpCtxPush(&s.ctx, s.wire.active);
+        pushPassiveWire(s.wire.active);
         s.wire.active = 'L';
     }
 }
 
+// s.ctx holds the passive wire; only the tail the action leaves past it is
+// pushed, checked and popped again.
 static bool wireWillBeValid(char action) {
-    char *w = wOpNextW(s.wire.passive, s.wire.active, action);
-    bool valid = wOpIsValid(w);
+    char *w = wOpNextW("", s.wire.active, action);
+    size_t n = strlen(w);
+    for (size_t i = 0; i < n; ++i) {
+        wOpCtxPush(&s.ctx, w[i]);
+    }
+    bool valid = wOpCtxIsValid(&s.ctx);
+    for (size_t i = 0; i < n; ++i) {
+        wOpCtxPop(&s.ctx);
+    }
     free(w);
     return valid;
 }
@@ -0,0 +1,246 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wop.h"
+
+#define BL 65536 // Block of Lines read, validated and written at once
+#define CH 64 // Chunk of lines a worker takes at once
+#define RB 65536 // Read Block size for unmappable inputs
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+
+typedef struct {
+    char *p;
+    size_t n, m, off;
+    bool mapped, eof;
+    int fd;
+} In;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t work, done;
+    size_t gen, busy, next, nl;
+    bool quit;
+    const char *p;
+    const size_t *off, *len;
+    char *v;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, false, NULL, NULL, NULL, NULL};
+
+static bool openIn(In *in, const char *path);
+static void closeIn(In *in);
+static size_t nextBlock(In *in, size_t *off, size_t *len);
+static void *worker(void *arg);
+static char judge(const char *l, size_t n, WOpCtx *c);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+    long nt = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = "-";
+    for (int i = 1; i < argc; i++) {
+        if (argc > i+1 && strcmp(argv[i], "-j") == 0) {
+            nt = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--exhaustive") == 0) {
+            wOpBroadPhase = false;
+        } else {
+            path = argv[i];
+        }
+    }
+    nt = nt < 1 ? 1 : nt;
+
+    In in;
+    if (!openIn(&in, path)) {
+        perror(path);
+        return 1;
+    }
+
+    pthread_t *t = malloc(nt * sizeof(*t));
+    for (long i = 0; i < nt; ++i) {
+        pthread_create(t + i, NULL, worker, NULL);
+    }
+
+    size_t *off = malloc(BL * sizeof(*off));
+    size_t *len = malloc(BL * sizeof(*len));
+    char *v = malloc(BL);
+    size_t np = 0, ns = 0, nv = 0;
+    double start = now();
+
+    for (size_t nl; (nl = nextBlock(&in, off, len)) > 0;) {
+        pthread_mutex_lock(&pool.mu);
+        pool.p = in.p;
+        pool.off = off;
+        pool.len = len;
+        pool.v = v;
+        pool.nl = nl;
+        pool.next = 0;
+        pool.busy = nt;
+        ++pool.gen;
+        pthread_cond_broadcast(&pool.work);
+        while (pool.busy > 0) {
+            pthread_cond_wait(&pool.done, &pool.mu);
+        }
+        pthread_mutex_unlock(&pool.mu);
+
+        for (size_t i = 0; i < nl; ++i) {
+            puts(v[i] == 'v' ? "valid" : v[i] == 'i' ? "invalid" : "malformed");
+            nv += v[i] == 'v';
+            ns += len[i];
+        }
+        np += nl;
+    }
+
+    double dt = now() - start;
+    fflush(stdout);
+    fprintf(stderr, "%zu programs (%zu valid), %zu segments in %.3f s on %ld threads: %.0f programs/s, %.0f segments/s\n",
+            np, nv, ns, dt, nt, np / dt, ns / dt);
+
+    pthread_mutex_lock(&pool.mu);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mu);
+    for (long i = 0; i < nt; ++i) {
+        pthread_join(t[i], NULL);
+    }
+
+    free(v);
+    free(len);
+    free(off);
+    free(t);
+    closeIn(&in);
+}
+
+// Regular files are mapped whole; anything else is read in blocks, keeping
+// only the lines not yet validated.
+static bool openIn(In *in, const char *path) {
+    struct stat st;
+    memset(in, 0, sizeof(*in));
+    in->fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+    if (in->fd < 0 || fstat(in->fd, &st) != 0) {
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        in->p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (in->p != MAP_FAILED) {
+            posix_madvise(in->p, st.st_size, POSIX_MADV_SEQUENTIAL);
+            in->n = st.st_size;
+            in->mapped = in->eof = true;
+            return true;
+        }
+    }
+    in->m = RB * 2;
+    in->p = malloc(in->m);
+    return true;
+}
+
+static void closeIn(In *in) {
+    if (in->mapped) {
+        munmap(in->p, in->n);
+    } else {
+        free(in->p);
+    }
+    if (in->fd > 0) {
+        close(in->fd);
+    }
+}
+
+// Finds up to BL lines past in->off, recording where they start and how long
+// they are, and moves in->off past them.
+static size_t nextBlock(In *in, size_t *off, size_t *len) {
+    if (!in->mapped) {
+        memmove(in->p, in->p + in->off, in->n - in->off);
+        in->n -= in->off;
+        in->off = 0;
+    }
+
+    size_t nl = 0;
+    size_t i = in->off;
+    while (nl < BL) {
+        char *e = memchr(in->p + i, '\n', in->n - i);
+        if (e == NULL && !in->eof) {
+            if (in->m < in->n + RB) {
+                in->m = (in->n + RB) * 2;
+                in->p = realloc(in->p, in->m);
+            }
+            ssize_t r = read(in->fd, in->p + in->n, RB);
+            in->eof = r <= 0;
+            in->n += r > 0 ? r : 0;
+            continue;
+        }
+        size_t j = e ? (size_t)(e - in->p) : in->n;
+        if (j == in->n && i == in->n) {
+            break;
+        }
+        off[nl] = i;
+        len[nl] = j > i && in->p[j - 1] == '\r' ? j - i - 1 : j - i;
+        ++nl;
+        i = e ? j + 1 : j;
+    }
+    in->off = i;
+    return nl;
+}
+
+static void *worker(void *arg) {
+    WOpCtx c = wOpCtxNew();
+    size_t gen = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&pool.mu);
+    while (true) {
+        while (pool.gen == gen && !pool.quit) {
+            pthread_cond_wait(&pool.work, &pool.mu);
+        }
+        if (pool.quit) {
+            break;
+        }
+        gen = pool.gen;
+        while (pool.next < pool.nl) {
+            size_t a = pool.next;
+            size_t b = MIN(a + CH, pool.nl);
+            pool.next = b;
+            pthread_mutex_unlock(&pool.mu);
+            for (size_t i = a; i < b; ++i) {
+                pool.v[i] = judge(pool.p + pool.off[i], pool.len[i], &c);
+            }
+            pthread_mutex_lock(&pool.mu);
+        }
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.mu);
+
+    wOpCtxDel(&c);
+    return NULL;
+}
+
+// Judges the n characters of program l valid ('v'), invalid ('i') or
+// malformed ('m'). Each worker keeps its context between programs: it is
+// popped empty and refilled, and the levels it still caches make a prefix
+// shared with the previous program cost nothing.
+static char judge(const char *l, size_t n, WOpCtx *c) {
+    for (size_t i = 0; i < n; ++i) {
+        if (l[i] != 'U' && l[i] != 'D' && l[i] != 'R') {
+            return 'm';
+        }
+    }
+    while (c->n > 0) {
+        wOpCtxPop(c);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        wOpCtxPush(c, l[i]);
+    }
+    return wOpCtxIsValid(c) ? 'v' : 'i';
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
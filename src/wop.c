@@ -5,12 +5,65 @@
 
 #include "wop.h"
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VW 4 // Vector Width, in doubles
+typedef __m256d V;
+#define VLD(p) _mm256_load_pd(p)
+#define V1(x) _mm256_set1_pd(x)
+#define VADD(a,b) _mm256_add_pd(a,b)
+#define VSUB(a,b) _mm256_sub_pd(a,b)
+#define VMUL(a,b) _mm256_mul_pd(a,b)
+#define VAND(a,b) _mm256_and_pd(a,b)
+#define VOR(a,b) _mm256_or_pd(a,b)
+#define VABS(x) _mm256_andnot_pd(V1(-0.0),x)
+#define VLT(a,b) _mm256_cmp_pd(a,b,_CMP_LT_OQ)
+#define VMASK(x) _mm256_movemask_pd(x)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VW 2
+typedef __m128d V;
+#define VLD(p) _mm_load_pd(p)
+#define V1(x) _mm_set1_pd(x)
+#define VADD(a,b) _mm_add_pd(a,b)
+#define VSUB(a,b) _mm_sub_pd(a,b)
+#define VMUL(a,b) _mm_mul_pd(a,b)
+#define VAND(a,b) _mm_and_pd(a,b)
+#define VOR(a,b) _mm_or_pd(a,b)
+#define VABS(x) _mm_andnot_pd(V1(-0.0),x)
+#define VLT(a,b) _mm_cmplt_pd(a,b)
+#define VMASK(x) _mm_movemask_pd(x)
+#else
+#define VW 1
+typedef double V;
+#define VLD(p) (*(p))
+#define V1(x) (x)
+#define VADD(a,b) ((a)+(b))
+#define VSUB(a,b) ((a)-(b))
+#define VMUL(a,b) ((a)*(b))
+#define VAND(a,b) ((a)!=0&&(b)!=0)
+#define VOR(a,b) ((a)!=0||(b)!=0)
+#define VABS(x) fabs(x)
+#define VLT(a,b) ((a)<(b))
+#define VMASK(x) ((x)!=0)
+#endif
+#define VA (VW * sizeof(double)) // Vector Alignment, in bytes
+
 #define IS0(x) (fabs(x)<0.0009765625)
+#define LV(v) ((v).a + (v).b * PI / 2) // Value of a WOpLat
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define MAX(x,y) ((x)>(y)?(x):(y))
 
 #define PI 3.1415926535
 #define SM 0.99
+#define GR 1.25 // Greatest distance of a part from the middle of its ends
+#define GS (GR * 2) // Grid cell Size
+#define LQ 26353589 // PI / 2 in units of 2^-24, for grid cells of WOpLat sums
+#define NIL ((size_t)-1)
+#define WK 64 // Wire parts per Kept pose
+#define BP 0.01 // Bounding box Padding, above the IS0 tolerance
+
+static const double QX[4] = {1, 0, -1, 0}, QY[4] = {0, 1, 0, -1}; // Unit step facing "RULD"[q]
 
 typedef struct {
     double x, y, a, l;
@@ -32,12 +85,102 @@ typedef struct {
     } c;
 } Curve;
 
-static Curve *buildCurve(const char *w);
-static void buildCurvePart(char w, double *x, double *y, char *dir, Curve *c);
-static void buildLine(Curve *c, Line line, double t);
-static void buildArc(Curve *c, Arc arc, double t);
-static bool detectCollision(size_t l, const Curve *c);
-static bool detectCurveCollision(Curve a, Curve b);
+typedef struct {
+    double x0, y0, x1, y1;
+} Box;
+
+// Lines and arcs of a set of parts, each field in its own array aligned to
+// whole vectors. Lines also keep their direction, so that the batch kernels
+// need no trigonometry.
+typedef struct {
+    size_t nl, ml, na, ma;
+    double *lx, *ly, *la, *ll, *lc, *ls;
+    double *ax, *ay, *ar, *ao, *aa;
+} Curves;
+
+// One wire segment: its bounding box and where the curves outlining it lie
+// in the Curves it was built into, four lines or two lines and two arcs.
+typedef struct {
+    Box b;
+    size_t l, a, nl, na;
+} Part;
+
+// One pushed segment of a WOpCtx. Geometry lives in the frame of the free end
+// of the wire, so it never moves when segments are pushed at the machine end.
+struct WOpLevel {
+    char w, dir;
+    int hit, cx, cy;
+    bool coll;
+    WOpLat x, y;
+    size_t next;
+    Part p;
+    Box u; // Union of the part boxes up to this level
+    Box r; // Bounds of the getRect points up to this level
+};
+
+// Grid cell of a WOpCtx, heading the stack-ordered list of levels whose
+// midpoints fall into it. Cells are never removed, only emptied.
+struct WOpCell {
+    bool used;
+    int x, y;
+    size_t head;
+};
+
+// Outcome of detectPartCollision for a part placed relative to another,
+// keyed exactly by their lattice offset in the frame of the first one.
+struct WOpMemo {
+    bool used, coll;
+    unsigned char w; // Both parts and the relative direction, 2 bits each
+    WOpLat x, y;
+};
+
+// Curves of a WOpCtx. Those of the levels are stacked like them, counting
+// only the pushed ones but keeping the cached ones above.
+struct WOpCurves {
+    Curves l;
+    Curves pack; // Curves near the machine, gathered for the batch kernels
+    Curves memo; // Parts rebuilt to decide a placement
+};
+
+bool wOpBroadPhase = true;
+
+static Part *buildCurve(const char *w, Curves *k);
+static void buildCurvePart(Curves *k, char w, double *x, double *y, char *dir, Part *p);
+static void buildCurvePartBack(Curves *k, char w, WOpLat *x, WOpLat *y, char *dir, Part *p);
+static void stepBack(char w, WOpLat *x, WOpLat *y, char *dir);
+static void latTurn(int q, WOpLat *x, WOpLat *y);
+static void rectPoint(Box *r, char w, double x, double y, char dir);
+static WOpRect ctxRect(const WOpCtx *c, const char *t);
+static char turn(char dir, int q);
+static int quarter(char dir);
+static int partCode(char w);
+static void buildLine(Curves *k, Line line, double t);
+static void buildArc(Curves *k, Arc arc, double t);
+static Box curveBox(Curve c);
+static bool boxesOverlap(Box a, Box b);
+static bool detectCollision(const Curves *k, size_t l, const Part *p);
+static void buildMachine(Curve *x);
+static size_t moveCurve(Curve c, double x, double y, char dir, Curve *m);
+static bool detectMachineCollision(WOpCtx *c);
+static bool detectPartCollision(const Curves *k, const Part *a, const Part *b);
+static bool detectLevelCollision(WOpCtx *c, const struct WOpLevel *a, const struct WOpLevel *b);
+static struct WOpMemo *memoCell(WOpCtx *c, unsigned char w, WOpLat x, WOpLat y);
+static void memoGrow(WOpCtx *c);
+static void addLine(Curves *k, Line l, double c, double s);
+static void addArc(Curves *k, Arc a);
+static size_t newLine(Curves *k);
+static size_t newArc(Curves *k);
+static Line lineAt(const Curves *k, size_t i);
+static Arc arcAt(const Curves *k, size_t i);
+static void addPart(Curves *k, const Curves *f, const Part *p);
+static double *growArray(double *p, size_t n, size_t m);
+static void curvesDel(Curves *k);
+static bool collCurves(const Curves *k, Curve m);
+static bool collLines(const Curves *k, Curve m);
+static bool collArcs(const Curves *k, Curve m);
+static size_t *gridCell(WOpCtx *c, int x, int y, bool add);
+static int gridAt(WOpLat v, WOpLat p);
+static void gridGrow(WOpCtx *c);
 static bool collLineLine(Line a, Line b);
 static bool collLineArc(Line a, Arc b);
 static bool collArcArc(Arc a, Arc b);
@@ -46,168 +189,610 @@ static double s(double x);
 static double ctg(double a);
 static double len(double x1, double y1, double x2, double y2);
 static WOpRect getRect(const char *w);
+static WOpRect walkRect(Box b, WOpLat x, WOpLat y, char dir, const char *t);
+static WOpRect machineRect(Box b, double x, double y, char dir);
+static void wirePose(const WOpWire *w, size_t k, WOpLat *x, WOpLat *y, char *dir);
+static unsigned get2(const unsigned char *b, size_t k);
+static void set2(unsigned char *b, size_t k, unsigned v);
 static WOpRect linRectInterpolation(WOpRect r0, WOpRect r1, float dt);
 
 bool wOpIsValid(const char *w) {
-    Curve *c = buildCurve(w);
-    bool collision = detectCollision(strlen(w), c);
-    free(c);
+    if (wOpBroadPhase) {
+        WOpCtx ctx = wOpCtxNew();
+        for (size_t i = 0; w[i]; ++i) {
+            wOpCtxPush(&ctx, w[i]);
+        }
+        bool valid = wOpCtxIsValid(&ctx);
+        wOpCtxDel(&ctx);
+        return valid;
+    }
+
+    Curves k = {0};
+    Part *p = buildCurve(w, &k);
+    bool collision = detectCollision(&k, strlen(w), p);
+    free(p);
+    curvesDel(&k);
     return !collision;
 }
 
-static Curve *buildCurve(const char *w) {
-    size_t l = strlen(w);
-    double x[2] = {0, 0};
-    double y[2] = {0, 0};
-    char dir = 'R';
-    Curve *c = malloc(l * 4 * sizeof(*c));
+// Parts are built in the machine frame from the poses walked from the free
+// end of w, the machine end part first, into k. A first walk finds the
+// machine end the others are taken relative to.
+static Part *buildCurve(const char *w, Curves *k) {
+    size_t n = strlen(w);
+    Part *p = malloc(n * sizeof(*p));
+    WOpLat mx = {0, 0}, my = {0, 0};
+    char mdir = 'R';
+    for (size_t i = 0; i < n; ++i) {
+        stepBack(w[i], &mx, &my, &mdir);
+    }
+    int q = quarter(mdir);
+    WOpLat px = {0, 0}, py = {0, 0};
+    char pdir = 'R';
 
-    for (size_t i = l - 1; i < l; --i) {
-        size_t j = l - i - 1;
-        buildCurvePart(w[i], x, y, &dir, c + j * 4);
+    for (size_t i = 0; i < n; ++i) {
+        stepBack(w[i], &px, &py, &pdir);
+        WOpLat x = {px.a - mx.a, px.b - mx.b};
+        WOpLat y = {py.a - my.a, py.b - my.b};
+        latTurn(q, &x, &y);
+        double rx = LV(x);
+        double ry = LV(y);
+        char dir = turn(pdir, -q);
+        buildCurvePart(k, w[i], &rx, &ry, &dir, p + n - 1 - i);
     }
 
-    return c;
+    return p;
 }
 
-static void buildCurvePart(char w, double *x, double *y, char *dir, Curve *c) {
+static void buildCurvePart(Curves *k, char w, double *x, double *y, char *dir, Part *p) {
+    p->l = k->nl;
+    p->a = k->na;
     double a = PI / 2 * SM;
     if (*dir == 'U') {
         if (w == 'U') {
-            buildArc(c, (Arc){*x - 1, *y, 1, 0, a}, SM);
+            buildArc(k, (Arc){*x - 1, *y, 1, 0, a}, SM);
             *x -= 1;
             *y += 1;
             *dir = 'L';
         } else if (w == 'D') {
-            buildArc(c, (Arc){*x + 1, *y, 1, PI - a, a}, SM);
+            buildArc(k, (Arc){*x + 1, *y, 1, PI - a, a}, SM);
             *x += 1;
             *y += 1;
             *dir = 'R';
         } else {
-            buildLine(c, (Line){*x, *y, PI / 2, a}, SM);
+            buildLine(k, (Line){*x, *y, PI / 2, a}, SM);
             *y += PI / 2;
         }
     } else if (*dir == 'D') {
         if (w == 'U') {
-            buildArc(c, (Arc){*x + 1, *y, 1, PI, a}, SM);
+            buildArc(k, (Arc){*x + 1, *y, 1, PI, a}, SM);
             *x += 1;
             *y -= 1;
             *dir = 'R';
         } else if (w == 'D') {
-            buildArc(c, (Arc){*x - 1, *y, 1, PI * 2 - a, a}, SM);
+            buildArc(k, (Arc){*x - 1, *y, 1, PI * 2 - a, a}, SM);
             *x -= 1;
             *y -= 1;
             *dir = 'L';
         } else {
-            buildLine(c, (Line){*x, *y, PI * 3 / 2, a}, SM);
+            buildLine(k, (Line){*x, *y, PI * 3 / 2, a}, SM);
             *y -= PI / 2;
         }
     } else if (*dir == 'L') {
         if (w == 'U') {
-            buildArc(c, (Arc){*x, *y - 1, 1, PI / 2, a}, SM);
+            buildArc(k, (Arc){*x, *y - 1, 1, PI / 2, a}, SM);
             *x -= 1;
             *y -= 1;
             *dir = 'D';
         } else if (w == 'D') {
-            buildArc(c, (Arc){*x, *y + 1, 1, PI * 3 / 2 - a, a}, SM);
+            buildArc(k, (Arc){*x, *y + 1, 1, PI * 3 / 2 - a, a}, SM);
             *x -= 1;
             *y += 1;
             *dir = 'U';
         } else {
-            buildLine(c, (Line){*x, *y, PI, a}, SM);
+            buildLine(k, (Line){*x, *y, PI, a}, SM);
             *x -= PI / 2;
         }
     } else {
         if (w == 'U') {
-            buildArc(c, (Arc){*x, *y + 1, 1, PI * 3 / 2, a}, SM);
+            buildArc(k, (Arc){*x, *y + 1, 1, PI * 3 / 2, a}, SM);
             *x += 1;
             *y += 1;
             *dir = 'U';
         } else if (w == 'D') {
-            buildArc(c, (Arc){*x, *y - 1, 1, PI / 2 - a, a}, SM);
+            buildArc(k, (Arc){*x, *y - 1, 1, PI / 2 - a, a}, SM);
             *x += 1;
             *y -= 1;
             *dir = 'D';
         } else {
-            buildLine(c, (Line){*x, *y, 0, a}, SM);
+            buildLine(k, (Line){*x, *y, 0, a}, SM);
             *x += PI / 2;
         }
     }
+
+    p->nl = k->nl - p->l;
+    p->na = k->na - p->a;
+    p->b = (Box){INFINITY, INFINITY, -INFINITY, -INFINITY};
+    for (size_t i = 0; i < p->nl + p->na; ++i) {
+        size_t j = p->l + i;
+        double ex = k->lx[j] + k->lc[j] * k->ll[j], ey = k->ly[j] + k->ls[j] * k->ll[j];
+        Box b = i < p->nl ? (Box){MIN(k->lx[j], ex) - BP, MIN(k->ly[j], ey) - BP,
+                                  MAX(k->lx[j], ex) + BP, MAX(k->ly[j], ey) + BP}
+              : curveBox((Curve){true, .c.arc = arcAt(k, p->a + i - p->nl)});
+        p->b.x0 = MIN(p->b.x0, b.x0);
+        p->b.y0 = MIN(p->b.y0, b.y0);
+        p->b.x1 = MAX(p->b.x1, b.x1);
+        p->b.y1 = MAX(p->b.y1, b.y1);
+    }
+}
+
+// Inverse of buildCurvePart: (x, y, dir) is where the part ends and becomes
+// where it starts.
+static void buildCurvePartBack(Curves *k, char w, WOpLat *x, WOpLat *y, char *dir, Part *p) {
+    stepBack(w, x, y, dir);
+    double ex = LV(*x);
+    double ey = LV(*y);
+    char d = *dir;
+    buildCurvePart(k, w, &ex, &ey, &d, p);
 }
 
-static void buildLine(Curve *c, Line line, double t) {
+// Moves (x, y, dir) from where part w ends to where it starts, as
+// buildCurvePartBack does, without building the part. Lines move the PI / 2
+// count, bends the unit count, so the pose stays exact.
+static void stepBack(char w, WOpLat *x, WOpLat *y, char *dir) {
+    int lt = w == 'U' ? 1 : w == 'D' ? -1 : 0;
+    int q = (quarter(*dir) - lt) & 3;
+    int dx = QX[q] - lt * QY[q];
+    int dy = QY[q] + lt * QX[q];
+    *dir = "RULD"[q];
+    if (w == 'R') {
+        x->b -= dx;
+        y->b -= dy;
+    } else {
+        x->a -= dx;
+        y->a -= dy;
+    }
+}
+
+// Turns the offset (x, y) by q quarter turns clockwise, into the frame of a
+// pose facing "RULD"[q].
+static void latTurn(int q, WOpLat *x, WOpLat *y) {
+    WOpLat t = *x;
+    *x = q == 0 ? t : q == 1 ? *y : q == 2 ? (WOpLat){-t.a, -t.b} : (WOpLat){-y->a, -y->b};
+    *y = q == 0 ? *y : q == 1 ? (WOpLat){-t.a, -t.b} : q == 2 ? (WOpLat){-y->a, -y->b} : t;
+}
+
+// Adds to r the point getRect visits for part w ending at (x, y, dir): that
+// end, moved half a unit along the start direction of bends.
+static void rectPoint(Box *r, char w, double x, double y, char dir) {
+    if (w != 'R') {
+        int q = (quarter(dir) + (w == 'U' ? 3 : 1)) & 3;
+        x += QX[q] * 0.5;
+        y += QY[q] * 0.5;
+    }
+    r->x0 = MIN(r->x0, x);
+    r->y0 = MIN(r->y0, y);
+    r->x1 = MAX(r->x1, x);
+    r->y1 = MAX(r->y1, y);
+}
+
+static char turn(char dir, int q) {
+    return "RULD"[(quarter(dir) + 4 + q) % 4];
+}
+
+// Index of dir in "RULD", without searching the string.
+static int quarter(char dir) {
+    switch (dir) {
+    case 'U': return 1;
+    case 'L': return 2;
+    case 'D': return 3;
+    default: return 0;
+    }
+}
+
+// Index of part w in "RUD".
+static int partCode(char w) {
+    return w == 'U' ? 1 : w == 'D' ? 2 : 0;
+}
+
+static void buildLine(Curves *k, Line line, double t) {
+    double c = cos(line.a), sn = sin(line.a);
+    double pc = cos(line.a + PI / 2), ps = sin(line.a + PI / 2);
     double x1 = line.x + cos(line.a - PI / 2) * t / 2;
     double y1 = line.y + sin(line.a - PI / 2) * t / 2;
-    double x2 = line.x + cos(line.a + PI / 2) * t / 2;
-    double y2 = line.y + sin(line.a + PI / 2) * t / 2;
-    double x3 = x1 + cos(line.a) * line.l;
-    double y3 = y1 + sin(line.a) * line.l;
-    c[0] = (Curve){false, .c.line = {x1, y1, line.a, line.l}};
-    c[1] = (Curve){false, .c.line = {x2, y2, line.a, line.l}};
-    c[2] = (Curve){false, .c.line = {x1, y1, line.a + PI / 2, t}};
-    c[3] = (Curve){false, .c.line = {x3, y3, line.a + PI / 2, t}};
+    double x2 = line.x + pc * t / 2;
+    double y2 = line.y + ps * t / 2;
+    double x3 = x1 + c * line.l;
+    double y3 = y1 + sn * line.l;
+    addLine(k, (Line){x1, y1, line.a, line.l}, c, sn);
+    addLine(k, (Line){x2, y2, line.a, line.l}, c, sn);
+    addLine(k, (Line){x1, y1, line.a + PI / 2, t}, pc, ps);
+    addLine(k, (Line){x3, y3, line.a + PI / 2, t}, pc, ps);
 }
 
-static void buildArc(Curve *c, Arc arc, double t) {
+static void buildArc(Curves *k, Arc arc, double t) {
     double r = arc.r - t / 2;
     double a1 = arc.o;
     double a2 = arc.o + arc.a;
-    c[0] = (Curve){false, .c.line={arc.x+cos(a1)*r, arc.y+sin(a1)*r, a1, t}};
-    c[1] = (Curve){false, .c.line={arc.x+cos(a2)*r, arc.y+sin(a2)*r, a2, t}};
-    c[2] = (Curve){true, .c.arc = {arc.x, arc.y, r, arc.o, arc.a}};
-    c[3] = (Curve){true, .c.arc = {arc.x, arc.y, r + t, arc.o, arc.a}};
+    double c1 = cos(a1), s1 = sin(a1), c2 = cos(a2), s2 = sin(a2);
+    addLine(k, (Line){arc.x + c1 * r, arc.y + s1 * r, a1, t}, c1, s1);
+    addLine(k, (Line){arc.x + c2 * r, arc.y + s2 * r, a2, t}, c2, s2);
+    addArc(k, (Arc){arc.x, arc.y, r, arc.o, arc.a});
+    addArc(k, (Arc){arc.x, arc.y, r + t, arc.o, arc.a});
+}
+
+// Padded bounds of c. An arc spans its end points plus every axis extreme of
+// its circle that lies within its angle.
+static Box curveBox(Curve c) {
+    double x0, y0, x1, y1;
+    if (c.isArc) {
+        Arc a = c.c.arc;
+        x0 = MIN(a.x + cos(a.o) * a.r, a.x + cos(a.o + a.a) * a.r);
+        y0 = MIN(a.y + sin(a.o) * a.r, a.y + sin(a.o + a.a) * a.r);
+        x1 = MAX(a.x + cos(a.o) * a.r, a.x + cos(a.o + a.a) * a.r);
+        y1 = MAX(a.y + sin(a.o) * a.r, a.y + sin(a.o + a.a) * a.r);
+        for (int q = 0; q <= 4; ++q) {
+            if (q * PI / 2 >= a.o && q * PI / 2 <= a.o + a.a) {
+                x1 = q % 4 == 0 ? a.x + a.r : x1;
+                y1 = q == 1 ? a.y + a.r : y1;
+                x0 = q == 2 ? a.x - a.r : x0;
+                y0 = q == 3 ? a.y - a.r : y0;
+            }
+        }
+    } else {
+        Line l = c.c.line;
+        x0 = MIN(l.x, l.x + cos(l.a) * l.l);
+        y0 = MIN(l.y, l.y + sin(l.a) * l.l);
+        x1 = MAX(l.x, l.x + cos(l.a) * l.l);
+        y1 = MAX(l.y, l.y + sin(l.a) * l.l);
+    }
+    return (Box){x0 - BP, y0 - BP, x1 + BP, y1 + BP};
 }
 
-static bool detectCollision(size_t l, const Curve *c) {
+static bool boxesOverlap(Box a, Box b) {
+    return a.x0 <= b.x1 && b.x0 <= a.x1 && a.y0 <= b.y1 && b.y0 <= a.y1;
+}
+
+static bool detectCollision(const Curves *k, size_t l, const Part *p) {
     for (size_t i = 0; i < l; ++i) {
         for (size_t j = i + 1; j < l; ++j) {
-            for (size_t k = 0; k < 4; ++k) {
-                for (size_t g = 0; g < 4; ++g) {
-                    if (detectCurveCollision(c[i * 4 + k], c[j * 4 + g])) {
-                        return true;
-                    }
-                }
+            if (detectPartCollision(k, p + i, p + j)) {
+                return true;
             }
         }
     }
 
     Curve x[6];
+    buildMachine(x);
+    for (size_t j = 0; j < 6; ++j) {
+        if (collCurves(k, x[j])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void buildMachine(Curve *x) {
     x[0] = (Curve){true, .c.arc = {0,  1, SM / 2, 0, PI * 2 * SM}};
     x[1] = (Curve){true, .c.arc = {0, -1, SM / 2, 0, PI * 2 * SM}};
     x[2] = (Curve){false, .c.line = {-99, -SM / 2, 0, 98 + SM}};
     x[3] = (Curve){false, .c.line = {-99,  SM / 2, 0, 98 + SM}};
     x[4] = (Curve){false, .c.line = {-99, -SM / 2, PI / 2, SM}};
     x[5] = (Curve){false, .c.line = {SM - 1, -SM / 2, PI / 2, SM}};
+}
 
-    for (size_t i = 0; i < l * 4; ++i) {
-        for (size_t j = 0; j < 6; ++j) {
-            if (detectCurveCollision(c[i], x[j])) {
+// Places c, given in the machine frame, into a frame where the machine origin
+// sits at (x, y) facing dir. Arcs wrapping past 2PI are split, so up to two
+// curves are written to m.
+static size_t moveCurve(Curve c, double x, double y, char dir, Curve *m) {
+    int q = quarter(dir);
+    double cx = c.isArc ? c.c.arc.x : c.c.line.x;
+    double cy = c.isArc ? c.c.arc.y : c.c.line.y;
+    double mx = q == 0 ? cx : q == 1 ? -cy : q == 2 ? -cx : cy;
+    double my = q == 0 ? cy : q == 1 ? cx : q == 2 ? -cy : -cx;
+    if (!c.isArc) {
+        m[0] = (Curve){false, .c.line = {x + mx, y + my, c.c.line.a + q * PI / 2, c.c.line.l}};
+        return 1;
+    }
+    double o = c.c.arc.o + q * PI / 2;
+    o = o >= PI * 2 ? o - PI * 2 : o;
+    if (o + c.c.arc.a <= PI * 2) {
+        m[0] = (Curve){true, .c.arc = {x + mx, y + my, c.c.arc.r, o, c.c.arc.a}};
+        return 1;
+    }
+    m[0] = (Curve){true, .c.arc = {x + mx, y + my, c.c.arc.r, o, PI * 2 - o}};
+    m[1] = (Curve){true, .c.arc = {x + mx, y + my, c.c.arc.r, 0, o + c.c.arc.a - PI * 2}};
+    return 2;
+}
+
+// Tests the machine against the parts whose boxes meet each of its curves,
+// gathered into one pack and handed to the batch kernels at once. Without
+// the broad-phase the kernels take the curves of all levels as they lie.
+static bool detectMachineCollision(WOpCtx *c) {
+    const struct WOpLevel *top = c->l + c->n - 1;
+    Curve x[6], m[12];
+    size_t n = 0;
+    buildMachine(x);
+    for (size_t i = 0; i < 6; ++i) {
+        n += moveCurve(x[i], LV(top->x), LV(top->y), top->dir, m + n);
+    }
+    Curves *k = &c->k->pack;
+    for (size_t j = 0; j < n; ++j) {
+        Box b = curveBox(m[j]);
+        if (!boxesOverlap(top->u, b)) {
+            continue;
+        }
+        if (!wOpBroadPhase) {
+            if (collCurves(&c->k->l, m[j])) {
                 return true;
             }
+            continue;
         }
-    }
 
+        b.x0 = MAX(b.x0, top->u.x0);
+        b.y0 = MAX(b.y0, top->u.y0);
+        b.x1 = MIN(b.x1, top->u.x1);
+        b.y1 = MIN(b.y1, top->u.y1);
+        k->nl = k->na = 0;
+        for (int gx = floor((b.x0 - GR - BP) / GS); gx <= floor((b.x1 + GR + BP) / GS); ++gx) {
+            for (int gy = floor((b.y0 - GR - BP) / GS); gy <= floor((b.y1 + GR + BP) / GS); ++gy) {
+                size_t *h = gridCell(c, gx, gy, false);
+                for (size_t i = h ? *h : NIL; i != NIL; i = c->l[i].next) {
+                    if (boxesOverlap(c->l[i].p.b, b)) {
+                        addPart(k, &c->k->l, &c->l[i].p);
+                    }
+                }
+            }
+        }
+        if (collCurves(k, m[j])) {
+            return true;
+        }
+    }
     return false;
 }
 
-static bool detectCurveCollision(Curve a, Curve b) {
-    if (a.isArc) {
-        if (b.isArc) {
-            if (collArcArc(a.c.arc, b.c.arc)) {
+// Tests every curve of a against every curve of b, both built into k: each
+// kind against each kind, so no test looks at what a curve is.
+static bool detectPartCollision(const Curves *k, const Part *a, const Part *b) {
+    if (!boxesOverlap(a->b, b->b)) {
+        return false;
+    }
+    for (size_t i = a->l; i < a->l + a->nl; ++i) {
+        Line l = lineAt(k, i);
+        for (size_t j = b->l; j < b->l + b->nl; ++j) {
+            if (collLineLine(l, lineAt(k, j))) {
                 return true;
             }
-        } else {
-            if (collLineArc(b.c.line, a.c.arc)) {
+        }
+        for (size_t j = b->a; j < b->a + b->na; ++j) {
+            if (collLineArc(l, arcAt(k, j))) {
                 return true;
             }
         }
-    } else {
-        if (b.isArc) {
-            if (collLineArc(a.c.line, b.c.arc)) {
+    }
+    for (size_t i = a->a; i < a->a + a->na; ++i) {
+        Arc r = arcAt(k, i);
+        for (size_t j = b->l; j < b->l + b->nl; ++j) {
+            if (collLineArc(lineAt(k, j), r)) {
                 return true;
             }
-        } else {
-            if (collLineLine(a.c.line, b.c.line)) {
+        }
+        for (size_t j = b->a; j < b->a + b->na; ++j) {
+            if (collArcArc(r, arcAt(k, j))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// detectPartCollision on the parts of levels a and b, decided once for every
+// placement of b relative to a. The lattice offset is exact, so the parts are
+// rebuilt near the origin in the frame of a and the outcome no longer depends
+// on how far from the free end they lie; every later meeting of the same
+// placement is a table lookup.
+static bool detectLevelCollision(WOpCtx *c, const struct WOpLevel *a, const struct WOpLevel *b) {
+    if (!boxesOverlap(a->p.b, b->p.b)) {
+        return false;
+    }
+    int q = quarter(a->dir);
+    WOpLat x = {b->x.a - a->x.a, b->x.b - a->x.b};
+    WOpLat y = {b->y.a - a->y.a, b->y.b - a->y.b};
+    latTurn(q, &x, &y);
+    char dir = turn(b->dir, -q);
+    unsigned char w = partCode(a->w) | partCode(b->w) << 2 | quarter(dir) << 4;
+
+    struct WOpMemo *m = memoCell(c, w, x, y);
+    if (!m->used) {
+        Curves *k = &c->k->memo;
+        Part pa, pb;
+        double ax = 0, ay = 0, bx = LV(x), by = LV(y);
+        char adir = 'R';
+        k->nl = k->na = 0;
+        buildCurvePart(k, a->w, &ax, &ay, &adir, &pa);
+        buildCurvePart(k, b->w, &bx, &by, &dir, &pb);
+        *m = (struct WOpMemo){true, detectPartCollision(k, &pa, &pb), w, x, y};
+        ++c->nh;
+    }
+    return m->coll;
+}
+
+// Finds the entry of placement (w, x, y), unused if it was never decided.
+static struct WOpMemo *memoCell(WOpCtx *c, unsigned char w, WOpLat x, WOpLat y) {
+    if (c->nh * 2 >= c->mh) {
+        memoGrow(c);
+    }
+    size_t i = ((size_t)w * 2654435761u ^ (size_t)x.a * 73856093u ^ (size_t)x.b * 19349663u
+              ^ (size_t)y.a * 83492791u ^ (size_t)y.b * 50331653u) & (c->mh - 1);
+    for (; c->h[i].used; i = (i + 1) & (c->mh - 1)) {
+        struct WOpMemo *m = c->h + i;
+        if (m->w == w && m->x.a == x.a && m->x.b == x.b && m->y.a == y.a && m->y.b == y.b) {
+            break;
+        }
+    }
+    return c->h + i;
+}
+
+static void memoGrow(WOpCtx *c) {
+    struct WOpMemo *old = c->h;
+    size_t mh = c->mh;
+    c->mh = c->mh ? c->mh * 2 : 256;
+    c->h = calloc(c->mh, sizeof(*c->h));
+    for (size_t i = 0; i < mh; ++i) {
+        if (old[i].used) {
+            *memoCell(c, old[i].w, old[i].x, old[i].y) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Adds l, whose direction is (c, s), to k.
+static void addLine(Curves *k, Line l, double c, double s) {
+    size_t i = newLine(k);
+    k->lx[i] = l.x;
+    k->ly[i] = l.y;
+    k->la[i] = l.a;
+    k->ll[i] = l.l;
+    k->lc[i] = c;
+    k->ls[i] = s;
+}
+
+static void addArc(Curves *k, Arc a) {
+    size_t i = newArc(k);
+    k->ax[i] = a.x;
+    k->ay[i] = a.y;
+    k->ar[i] = a.r;
+    k->ao[i] = a.o;
+    k->aa[i] = a.a;
+}
+
+// Index of a line added at the end of k, growing its arrays.
+static size_t newLine(Curves *k) {
+    if (k->nl >= k->ml) {
+        size_t m = k->ml ? k->ml * 2 : 64;
+        k->lx = growArray(k->lx, k->ml, m);
+        k->ly = growArray(k->ly, k->ml, m);
+        k->la = growArray(k->la, k->ml, m);
+        k->ll = growArray(k->ll, k->ml, m);
+        k->lc = growArray(k->lc, k->ml, m);
+        k->ls = growArray(k->ls, k->ml, m);
+        k->ml = m;
+    }
+    return k->nl++;
+}
+
+static size_t newArc(Curves *k) {
+    if (k->na >= k->ma) {
+        size_t m = k->ma ? k->ma * 2 : 64;
+        k->ax = growArray(k->ax, k->ma, m);
+        k->ay = growArray(k->ay, k->ma, m);
+        k->ar = growArray(k->ar, k->ma, m);
+        k->ao = growArray(k->ao, k->ma, m);
+        k->aa = growArray(k->aa, k->ma, m);
+        k->ma = m;
+    }
+    return k->na++;
+}
+
+static Line lineAt(const Curves *k, size_t i) {
+    return (Line){k->lx[i], k->ly[i], k->la[i], k->ll[i]};
+}
+
+static Arc arcAt(const Curves *k, size_t i) {
+    return (Arc){k->ax[i], k->ay[i], k->ar[i], k->ao[i], k->aa[i]};
+}
+
+// Copies the curves of p, built into f, to the end of k.
+static void addPart(Curves *k, const Curves *f, const Part *p) {
+    for (size_t i = p->l; i < p->l + p->nl; ++i) {
+        size_t j = newLine(k);
+        k->lx[j] = f->lx[i];
+        k->ly[j] = f->ly[i];
+        k->la[j] = f->la[i];
+        k->ll[j] = f->ll[i];
+        k->lc[j] = f->lc[i];
+        k->ls[j] = f->ls[i];
+    }
+    for (size_t i = p->a; i < p->a + p->na; ++i) {
+        size_t j = newArc(k);
+        k->ax[j] = f->ax[i];
+        k->ay[j] = f->ay[i];
+        k->ar[j] = f->ar[i];
+        k->ao[j] = f->ao[i];
+        k->aa[j] = f->aa[i];
+    }
+}
+
+// Moves the first n of the doubles at p into a new VA aligned array of m,
+// which the vector kernels load whole.
+static double *growArray(double *p, size_t n, size_t m) {
+    void *q = NULL;
+    if (posix_memalign(&q, VA, m * sizeof(*p)) != 0) {
+        abort();
+    }
+    if (n > 0) {
+        memcpy(q, p, n * sizeof(*p));
+    }
+    free(p);
+    return q;
+}
+
+static void curvesDel(Curves *k) {
+    double *a[] = {k->lx, k->ly, k->la, k->ll, k->lc, k->ls, k->ax, k->ay, k->ar, k->ao, k->aa};
+    for (size_t i = 0; i < sizeof(a) / sizeof(*a); ++i) {
+        free(a[i]);
+    }
+    memset(k, 0, sizeof(*k));
+}
+
+// Whether any curve of k meets m.
+static bool collCurves(const Curves *k, Curve m) {
+    return collLines(k, m) || collArcs(k, m);
+}
+
+// The batch kernels rule out VW curves at a time where they are more than BP
+// clear of m: a line with both ends on one side of the other line, a line
+// missing a circle or with both ends inside it, circles apart or one inside
+// the other. The tolerances of the exact tests are well under BP, so only
+// the curves left go through them, and the outcome is theirs.
+static bool collLines(const Curves *k, Curve m) {
+    V bp = V1(BP), nbp = V1(-BP);
+    if (m.isArc) {
+        Arc b = m.c.arc;
+        V cx = V1(b.x), cy = V1(b.y), ro = V1(b.r + BP), ri = V1(s(MAX(b.r - BP, 0)));
+        for (size_t i = 0; i < k->nl; i += VW) {
+            V x = VSUB(VLD(k->lx + i), cx), y = VSUB(VLD(k->ly + i), cy);
+            V c = VLD(k->lc + i), sn = VLD(k->ls + i), l = VLD(k->ll + i);
+            V ex = VADD(x, VMUL(c, l)), ey = VADD(y, VMUL(sn, l));
+            V d = VABS(VSUB(VMUL(sn, x), VMUL(c, y)));
+            V in = VAND(VLT(VADD(VMUL(x, x), VMUL(y, y)), ri), VLT(VADD(VMUL(ex, ex), VMUL(ey, ey)), ri));
+            int r = VMASK(VOR(VLT(ro, d), in));
+            for (size_t j = i; j < i + VW && j < k->nl; ++j) {
+                if (!(r >> (j - i) & 1) && collLineArc(lineAt(k, j), b)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    Line a = m.c.line;
+    double ac = cos(a.a), as = sin(a.a);
+    V mx = V1(a.x), my = V1(a.y), mc = V1(ac), ms = V1(as);
+    V mex = V1(a.x + ac * a.l), mey = V1(a.y + as * a.l);
+    for (size_t i = 0; i < k->nl; i += VW) {
+        V x = VLD(k->lx + i), y = VLD(k->ly + i), c = VLD(k->lc + i), sn = VLD(k->ls + i);
+        V l = VLD(k->ll + i);
+        V ex = VADD(x, VMUL(c, l)), ey = VADD(y, VMUL(sn, l));
+        V o0 = VSUB(VMUL(mc, VSUB(y, my)), VMUL(ms, VSUB(x, mx)));
+        V o1 = VSUB(VMUL(mc, VSUB(ey, my)), VMUL(ms, VSUB(ex, mx)));
+        V q0 = VSUB(VMUL(c, VSUB(my, y)), VMUL(sn, VSUB(mx, x)));
+        V q1 = VSUB(VMUL(c, VSUB(mey, y)), VMUL(sn, VSUB(mex, x)));
+        V side = VOR(VOR(VAND(VLT(bp, o0), VLT(bp, o1)), VAND(VLT(o0, nbp), VLT(o1, nbp))),
+                     VOR(VAND(VLT(bp, q0), VLT(bp, q1)), VAND(VLT(q0, nbp), VLT(q1, nbp))));
+        int r = VMASK(side);
+        for (size_t j = i; j < i + VW && j < k->nl; ++j) {
+            if (!(r >> (j - i) & 1) && collLineLine(lineAt(k, j), a)) {
                 return true;
             }
         }
@@ -215,6 +800,93 @@ static bool detectCurveCollision(Curve a, Curve b) {
     return false;
 }
 
+static bool collArcs(const Curves *k, Curve m) {
+    V bp = V1(BP);
+    if (m.isArc) {
+        Arc b = m.c.arc;
+        V cx = V1(b.x), cy = V1(b.y), r = V1(b.r);
+        for (size_t i = 0; i < k->na; i += VW) {
+            V x = VSUB(VLD(k->ax + i), cx), y = VSUB(VLD(k->ay + i), cy), ar = VLD(k->ar + i);
+            V d = VADD(VMUL(x, x), VMUL(y, y));
+            V ro = VADD(VADD(r, ar), bp);
+            V ri = VSUB(VABS(VSUB(r, ar)), bp);
+            V apart = VOR(VLT(VMUL(ro, ro), d), VAND(VLT(V1(0), ri), VLT(d, VMUL(ri, ri))));
+            int mask = VMASK(apart);
+            for (size_t j = i; j < i + VW && j < k->na; ++j) {
+                if (!(mask >> (j - i) & 1) && collArcArc(arcAt(k, j), b)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    Line a = m.c.line;
+    double ac = cos(a.a), as = sin(a.a);
+    V mx = V1(a.x), my = V1(a.y), mc = V1(ac), ms = V1(as);
+    V mex = V1(a.x + ac * a.l), mey = V1(a.y + as * a.l);
+    for (size_t i = 0; i < k->na; i += VW) {
+        V x = VLD(k->ax + i), y = VLD(k->ay + i), ar = VLD(k->ar + i);
+        V d = VABS(VSUB(VMUL(mc, VSUB(y, my)), VMUL(ms, VSUB(x, mx))));
+        V ri = VSUB(ar, bp);
+        V x0 = VSUB(mx, x), y0 = VSUB(my, y), x1 = VSUB(mex, x), y1 = VSUB(mey, y);
+        V in = VAND(VLT(VADD(VMUL(x0, x0), VMUL(y0, y0)), VMUL(ri, ri)),
+                    VLT(VADD(VMUL(x1, x1), VMUL(y1, y1)), VMUL(ri, ri)));
+        int mask = VMASK(VOR(VLT(VADD(ar, bp), d), VAND(VLT(V1(0), ri), in)));
+        for (size_t j = i; j < i + VW && j < k->na; ++j) {
+            if (!(mask >> (j - i) & 1) && collLineArc(a, arcAt(k, j))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Finds the list head of grid cell (x, y), creating the cell if add is set.
+static size_t *gridCell(WOpCtx *c, int x, int y, bool add) {
+    if (add && c->nc * 2 >= c->mc) {
+        gridGrow(c);
+    }
+    if (c->mc == 0) {
+        return NULL;
+    }
+    size_t i = ((size_t)x * 73856093u ^ (size_t)y * 19349663u) & (c->mc - 1);
+    for (; c->c[i].used; i = (i + 1) & (c->mc - 1)) {
+        if (c->c[i].x == x && c->c[i].y == y) {
+            return &c->c[i].head;
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    ++c->nc;
+    c->c[i] = (struct WOpCell){true, x, y, NIL};
+    return &c->c[i].head;
+}
+
+// Grid coordinate, along one axis, of the middle of the joints v and p,
+// taken from their integer sum in fixed point. LQ is off by under 2^-25 per
+// PI / 2, far inside the slack GR leaves and the BP the machine query adds.
+static int gridAt(WOpLat v, WOpLat p) {
+    long long s = (long long)(v.a + p.a) * (1 << 24) + (long long)(v.b + p.b) * LQ;
+    long long d = (long long)(GS * 2) * (1 << 24);
+    return s >= 0 ? s / d : -((-s + d - 1) / d);
+}
+
+static void gridGrow(WOpCtx *c) {
+    struct WOpCell *old = c->c;
+    size_t mc = c->mc;
+    c->mc = c->mc ? c->mc * 2 : 256;
+    c->c = calloc(c->mc, sizeof(*c->c));
+    c->nc = 0;
+    for (size_t i = 0; i < mc; ++i) {
+        if (old[i].used) {
+            *gridCell(c, old[i].x, old[i].y, true) = old[i].head;
+        }
+    }
+    free(old);
+}
+
 static bool collLineLine(Line a, Line b) {
     double l1, l2;
     if (IS0(a.a - b.a)) {
@@ -363,6 +1035,201 @@ static double len(double x1, double y1, double x2, double y2) {
     return sqrt(s(x1 - x2) + s(y1 - y2));
 }
 
+WOpCtx wOpCtxNew(void) {
+    return (WOpCtx){0, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL};
+}
+
+void wOpCtxDel(WOpCtx *c) {
+    free(c->l);
+    free(c->c);
+    free(c->h);
+    if (c->k) {
+        curvesDel(&c->k->l);
+        curvesDel(&c->k->pack);
+        curvesDel(&c->k->memo);
+        free(c->k);
+    }
+    memset(c, 0, sizeof(*c));
+}
+
+// Pushes w at the machine end of the wire. Only the new part is tested against
+// the parts below it, and with wOpBroadPhase only against those in the grid
+// cells around it; the machine test is deferred to wOpCtxIsValid. Popped
+// levels stay cached, so pushing the same part again costs nothing.
+void wOpCtxPush(WOpCtx *c, char w) {
+    if (c->k == NULL) {
+        c->k = calloc(1, sizeof(*c->k));
+    }
+    if (c->top > c->n && c->l[c->n].w == w) {
+        const Part *p = &c->l[c->n].p;
+        size_t *h = gridCell(c, c->l[c->n].cx, c->l[c->n].cy, true);
+        c->k->l.nl = p->l + p->nl;
+        c->k->l.na = p->a + p->na;
+        c->l[c->n].next = *h;
+        *h = c->n++;
+        return;
+    }
+    if (c->n >= c->m) {
+        c->m = c->m ? c->m * 2 : 64;
+        c->l = realloc(c->l, c->m * sizeof(*c->l));
+    }
+
+    struct WOpLevel *l = c->l + c->n;
+    const struct WOpLevel *p = c->n ? l - 1 : NULL;
+    l->w = w;
+    l->x = p ? p->x : (WOpLat){0, 0};
+    l->y = p ? p->y : (WOpLat){0, 0};
+    l->dir = p ? p->dir : 'R';
+    l->hit = -1;
+    l->coll = p && p->coll;
+    l->r = p ? p->r : (Box){INFINITY, INFINITY, -INFINITY, -INFINITY};
+    rectPoint(&l->r, w, LV(l->x), LV(l->y), l->dir);
+    buildCurvePartBack(&c->k->l, w, &l->x, &l->y, &l->dir, &l->p);
+    l->u = l->p.b;
+    if (p) {
+        l->u.x0 = MIN(l->u.x0, p->u.x0);
+        l->u.y0 = MIN(l->u.y0, p->u.y0);
+        l->u.x1 = MAX(l->u.x1, p->u.x1);
+        l->u.y1 = MAX(l->u.y1, p->u.y1);
+    }
+    l->cx = gridAt(l->x, p ? p->x : (WOpLat){0, 0});
+    l->cy = gridAt(l->y, p ? p->y : (WOpLat){0, 0});
+
+    for (size_t i = 0; i < c->n && !l->coll && !wOpBroadPhase; ++i) {
+        l->coll = detectLevelCollision(c, c->l + i, l);
+    }
+    for (int gx = l->cx - 1; gx <= l->cx + 1 && wOpBroadPhase; ++gx) {
+        for (int gy = l->cy - 1; gy <= l->cy + 1 && !l->coll; ++gy) {
+            size_t *h = gridCell(c, gx, gy, false);
+            for (size_t i = h ? *h : NIL; i != NIL && !l->coll; i = c->l[i].next) {
+                l->coll = detectLevelCollision(c, c->l + i, l);
+            }
+        }
+    }
+
+    size_t *h = gridCell(c, l->cx, l->cy, true);
+    l->next = *h;
+    *h = c->n;
+    c->top = ++c->n;
+}
+
+void wOpCtxPop(WOpCtx *c) {
+    if (c->n == 0) {
+        return;
+    }
+    struct WOpLevel *l = c->l + --c->n;
+    *gridCell(c, l->cx, l->cy, false) = l->next;
+    c->k->l.nl = l->p.l;
+    c->k->l.na = l->p.a;
+}
+
+bool wOpCtxIsValid(WOpCtx *c) {
+    if (c->n == 0) {
+        return true;
+    }
+    struct WOpLevel *l = c->l + c->n - 1;
+    if (l->coll) {
+        return false;
+    }
+    if (l->hit < 0) {
+        l->hit = detectMachineCollision(c);
+    }
+    return !l->hit;
+}
+
+// Same as wOpGetRect on the wire of c followed by wActive, and on the wire
+// it becomes after action, without walking either.
+WOpRect wOpCtxGetRect(const WOpCtx *c, char wActive, bool animation, char action, float dt) {
+    char w = wActive != 'L' ? wActive : c->n ? c->l[c->n - 1].w : 'L';
+
+    if (w == 'L' && action != 'R') {
+        return (WOpRect){0, 0, 0, 0};
+    }
+
+    char t0[2] = {wActive != 'L' ? wActive : '\0', '\0'};
+    WOpRect r0 = ctxRect(c, t0);
+
+    if (!animation || (w == action && w != 'R')) {
+        return r0;
+    }
+
+    char t1[3] = {'\0', '\0', '\0'};
+    if (action == 'R') {
+        t1[0] = wActive != 'L' ? wActive : 'R';
+        t1[1] = wActive != 'L' ? 'R' : '\0';
+    } else if (action != 'L') {
+        t1[0] = action;
+    }
+    WOpRect r1 = ctxRect(c, t1);
+    float dt2 = MIN(dt * 2, 1);
+    if (action == 'U' || action == 'D') {
+        return linRectInterpolation(r0, r1, dt2);
+    } else {
+        return linRectInterpolation(r0, r1, dt);
+    }
+}
+
+WOpWire wOpWireNew(void) {
+    return (WOpWire){0, 0, NULL, NULL, NULL, NULL, {0, 0}, {0, 0}};
+}
+
+void wOpWireDel(WOpWire *w) {
+    free(w->w);
+    free(w->d);
+    free(w->x);
+    free(w->y);
+    memset(w, 0, sizeof(*w));
+}
+
+// Appends c at the machine end. The poses of the parts already there are
+// kept from the free end, so they do not change.
+void wOpWirePush(WOpWire *w, char c) {
+    if (w->n >= w->m) {
+        w->m = w->m ? w->m * 2 : WK;
+        w->w = realloc(w->w, w->m / 4);
+        w->d = realloc(w->d, w->m / 4);
+        w->x = realloc(w->x, w->m / WK * sizeof(*w->x));
+        w->y = realloc(w->y, w->m / WK * sizeof(*w->y));
+    }
+    char dir = w->n ? "RULD"[get2(w->d, w->n - 1)] : 'R';
+    stepBack(c, &w->tx, &w->ty, &dir);
+    set2(w->w, w->n, partCode(c));
+    set2(w->d, w->n, quarter(dir));
+    if (++w->n % WK == 0) {
+        w->x[w->n / WK - 1] = w->tx;
+        w->y[w->n / WK - 1] = w->ty;
+    }
+}
+
+// Removes and returns the part at the machine end, '\0' if there is none.
+// The new last pose is walked from the one kept before it, WK steps at most.
+char wOpWirePop(WOpWire *w) {
+    if (w->n == 0) {
+        return '\0';
+    }
+    char c = wOpWireAt(w, --w->n);
+    char dir;
+    wirePose(w, w->n, &w->tx, &w->ty, &dir);
+    return c;
+}
+
+// Part k, counted from the free end.
+char wOpWireAt(const WOpWire *w, size_t k) {
+    return "RUD"[get2(w->w, k)];
+}
+
+// Where part k meets the part after it, or the machine, and the direction
+// pointing away from the machine there.
+void wOpWirePose(const WOpWire *w, size_t k, double *x, double *y, char *dir) {
+    WOpLat lx = w->tx, ly = w->ty;
+    if (k + 1 < w->n) {
+        wirePose(w, k + 1, &lx, &ly, dir);
+    }
+    *x = LV(lx);
+    *y = LV(ly);
+    *dir = "RULD"[get2(w->d, k)];
+}
+
 char *wOpCurrW(const char *wire, char wActive) {
     size_t n = strlen(wire);
     char *w = strcpy(malloc(n + 2), wire);
@@ -415,78 +1282,67 @@ WOpRect wOpGetRect(const char *w0, const char *w1, bool animation, char action,
     }
 }
 
+// getRect of the wire of c followed by t. The bounds kept by the top level
+// are extended by t and the machine end, then turned into the machine frame.
+static WOpRect ctxRect(const WOpCtx *c, const char *t) {
+    const struct WOpLevel *l = c->n ? c->l + c->n - 1 : NULL;
+    Box b = l ? l->r : (Box){INFINITY, INFINITY, -INFINITY, -INFINITY};
+    WOpLat x = l ? l->x : (WOpLat){0, 0};
+    WOpLat y = l ? l->y : (WOpLat){0, 0};
+    char dir = l ? l->dir : 'R';
+    return walkRect(b, x, y, dir, t);
+}
+
+// Bounds of the ends of the parts, those of bends moved half a unit along
+// their start direction, and of the machine, in the machine frame.
 static WOpRect getRect(const char *w) {
-    WOpRect r = {0, 0, 0, 0};
-    size_t l = strlen(w);
-    double x = 0;
-    double y = 0;
-    char dir = 'R';
-    char prevdir = dir;
-    for (size_t i = l - 1; i < l; --i) {
-        if (dir == 'U') {
-            if (w[i] == 'U') {
-                x -= 1;
-                y += 1;
-                dir = 'L';
-            } else if (w[i] == 'D') {
-                x += 1;
-                y += 1;
-                dir = 'R';
-            } else {
-                y += PI / 2;
-            }
-        } else if (dir == 'D') {
-            if (w[i] == 'U') {
-                x += 1;
-                y -= 1;
-                dir = 'R';
-            } else if (w[i] == 'D') {
-                x -= 1;
-                y -= 1;
-                dir = 'L';
-            } else {
-                y -= PI / 2;
-            }
-        } else if (dir == 'L') {
-            if (w[i] == 'U') {
-                x -= 1;
-                y -= 1;
-                dir = 'D';
-            } else if (w[i] == 'D') {
-                x -= 1;
-                y += 1;
-                dir = 'U';
-            } else {
-                x -= PI / 2;
-            }
+    return walkRect((Box){INFINITY, INFINITY, -INFINITY, -INFINITY}, (WOpLat){0, 0}, (WOpLat){0, 0}, 'R', w);
+}
+
+// Extends b by the parts of t, walked straight off the string from
+// (x, y, dir), and adds the machine end. This is rectPoint and stepBack
+// with the direction kept as its "RULD" index and the lattice counts as
+// doubles, which hold them exactly and give the values LV does, since the
+// app calls it every frame on the whole wire.
+static WOpRect walkRect(Box b, WOpLat x, WOpLat y, char dir, const char *t) {
+    int q = quarter(dir);
+    double xa = x.a, xb = x.b, ya = y.a, yb = y.b;
+    double px = LV(x), py = LV(y);
+    double x0 = b.x0, y0 = b.y0, x1 = b.x1, y1 = b.y1;
+    for (size_t i = 0; t[i]; ++i) {
+        double rx = px, ry = py;
+        if (t[i] == 'R') {
+            xb -= QX[q];
+            yb -= QY[q];
         } else {
-            if (w[i] == 'U') {
-                x += 1;
-                y += 1;
-                dir = 'U';
-            } else if (w[i] == 'D') {
-                x += 1;
-                y -= 1;
-                dir = 'D';
-            } else {
-                x += PI / 2;
-            }
+            int lt = t[i] == 'U' ? 1 : -1;
+            q = (q - lt) & 3;
+            rx += QX[q] * 0.5;
+            ry += QY[q] * 0.5;
+            xa -= QX[q] - lt * QY[q];
+            ya -= QY[q] + lt * QX[q];
         }
-        float ry = (prevdir == 'U' && w[i] != 'R') ? y + 0.5
-                 : (prevdir == 'D' && w[i] != 'R') ? y - 0.5
-                 : y;
-        float rx = (prevdir == 'R' && w[i] != 'R') ? x + 0.5
-                 : (prevdir == 'L' && w[i] != 'R') ? x - 0.5
-                 : x;
-        prevdir = dir;
-        r.x = MIN(r.x, rx);
-        r.y = MIN(r.y, ry);
-        r.w = MAX(r.w, rx);
-        r.h = MAX(r.h, ry);
+        px = xa + xb * (PI / 2);
+        py = ya + yb * (PI / 2);
+        x0 = MIN(x0, rx);
+        y0 = MIN(y0, ry);
+        x1 = MAX(x1, rx);
+        y1 = MAX(y1, ry);
     }
-    r.w = r.x < 0 ? r.w - r.x : r.w;
-    r.h = r.y < 0 ? r.h - r.y : r.h;
-    return r;
+    return machineRect((Box){x0, y0, x1, y1}, px, py, "RULD"[q]);
+}
+
+// Adds the machine end (x, y, dir) to b, given from the free end, and turns
+// b into the frame of the machine.
+static WOpRect machineRect(Box b, double x, double y, char dir) {
+    rectPoint(&b, 'R', x, y, dir);
+    int q = quarter(dir);
+    double x0 = b.x0 - x, y0 = b.y0 - y, x1 = b.x1 - x, y1 = b.y1 - y;
+    Box m = q == 0 ? (Box){x0, y0, x1, y1}
+          : q == 1 ? (Box){y0, -x1, y1, -x0}
+          : q == 2 ? (Box){-x1, -y1, -x0, -y0}
+          : (Box){-y1, x0, -y0, x1};
+    return (WOpRect){m.x0, m.y0, m.x1 - m.x0, m.y1 - m.y0};
 }
 
 static WOpRect linRectInterpolation(WOpRect r0, WOpRect r1, float dt) {
@@ -496,3 +1352,23 @@ static WOpRect linRectInterpolation(WOpRect r0, WOpRect r1, float dt) {
     r0.h += (r1.h - r0.h) * dt;
     return r0;
 }
+
+// Walks (x, y, dir) from the free end to where the first k parts end: from
+// the last pose kept at or before there, so WK - 1 steps at most.
+static void wirePose(const WOpWire *w, size_t k, WOpLat *x, WOpLat *y, char *dir) {
+    size_t j = k / WK * WK;
+    *x = j ? w->x[j / WK - 1] : (WOpLat){0, 0};
+    *y = j ? w->y[j / WK - 1] : (WOpLat){0, 0};
+    *dir = j ? "RULD"[get2(w->d, j - 1)] : 'R';
+    for (; j < k; ++j) {
+        stepBack(wOpWireAt(w, j), x, y, dir);
+    }
+}
+
+static unsigned get2(const unsigned char *b, size_t k) {
+    return b[k / 4] >> k % 4 * 2 & 3;
+}
+
+static void set2(unsigned char *b, size_t k, unsigned v) {
+    b[k / 4] = (b[k / 4] & ~(3u << k % 4 * 2)) | v << k % 4 * 2;
+}
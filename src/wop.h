@@ -5,3 +5,38 @@ bool wOpIsValid(const char *w);
 char *wOpCurrW(const char *wire, char wActive);
 char *wOpNextW(const char *wire, char wActive, char action);
 WOpRect wOpGetRect(const char *w0, const char *w1, bool animation, char action, float dt);
+
+typedef struct {
+    int a, b; // a + b * PI / 2, which every wire joint is exactly
+} WOpLat;
+
+// A wire of n parts, about 3/4 of a byte each: the machine end of each part,
+// from the free end, is kept only for every 64th part and the last one, and
+// walked from there for the others.
+typedef struct {
+    size_t n, m;
+    unsigned char *w, *d; // Parts ("RUD") and their machine end directions ("RULD"), 2 bits each
+    WOpLat *x, *y; // Machine end of parts 63, 127, 191...
+    WOpLat tx, ty; // Machine end of the last part
+} WOpWire;
+WOpWire wOpWireNew(void);
+void wOpWireDel(WOpWire *w);
+void wOpWirePush(WOpWire *w, char c);
+char wOpWirePop(WOpWire *w);
+char wOpWireAt(const WOpWire *w, size_t k);
+void wOpWirePose(const WOpWire *w, size_t k, double *x, double *y, char *dir);
+
+typedef struct {
+    size_t n, m, top, nc, mc, nh, mh;
+    struct WOpLevel *l;
+    struct WOpCell *c;
+    struct WOpMemo *h;
+    struct WOpCurves *k;
+} WOpCtx;
+extern bool wOpBroadPhase;
+WOpCtx wOpCtxNew(void);
+void wOpCtxDel(WOpCtx *c);
+void wOpCtxPush(WOpCtx *c, char w);
+void wOpCtxPop(WOpCtx *c);
+bool wOpCtxIsValid(WOpCtx *c);
+WOpRect wOpCtxGetRect(const WOpCtx *c, char wActive, bool animation, char action, float dt);